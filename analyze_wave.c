@@ -0,0 +1,393 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <unistd.h>
+#include "wave.h"
+#include "io.h"
+#include "fft.h"
+#include "convert.h"
+
+// Short-time spectral analysis of a rendered WAVE file, for checking
+// tuning and aliasing. The (mono downmixed) signal is cut into Hann
+// windowed frames; each thread takes a contiguous run of spectrogram
+// columns and reads its part of the file on its own file handle.
+
+#define FRAMES_PER_READ 64u     // even, to keep FFT frame pairs together
+#define FLOOR_DB        -120.0f
+#define IMAGE_RANGE_DB  100.0f
+
+typedef struct {
+  const char *filename;
+  long data_offset;
+  WaveFormat format;
+  unsigned num_samples;
+  unsigned fft_size;
+  unsigned hop;
+  unsigned num_frames;
+  unsigned width, height;
+  const FFTPlan *plan;
+  const float *window;
+  float power_scale;   // makes a full-scale sine peak at 0 dB
+
+  float *frame_freq;   // dominant frequency of each frame
+  float *frame_db;     // and its level
+  float *image;        // width x height, in dB
+
+  // per thread
+  unsigned first_column, end_column;
+  double *power_sum;   // fft_size/2 + 1 bins
+} Job;
+
+static float to_db(float power) {
+  float db = 10.0f * log10f(power + 1e-20f);
+  return db < FLOOR_DB ? FLOOR_DB : db;
+}
+
+static unsigned column_start(const Job *job, unsigned column) {
+  return (unsigned) ((uint64_t) job->num_frames * column / job->width);
+}
+
+// Read and downmix the samples for frames [first, first + count).
+// scratch is the thread's buffer for read_converted.
+static void read_frames(FILE *in, const Job *job, unsigned first, unsigned count,
+                        unsigned char scratch[], int16_t stereo[], float mono[]) {
+  unsigned start = first * job->hop;
+  unsigned len = (count - 1) * job->hop + job->fft_size;
+  if (fseek(in, job->data_offset + (long) start * job->format.block_align, SEEK_SET) != 0) {
+    fatal_error("Could not seek in input file");
+  }
+  read_converted(in, &job->format, stereo, len, scratch);
+  for (unsigned i = 0; i < len; i++) {
+    mono[i] = (stereo[2 * i] + stereo[2 * i + 1]) * (0.5f / 32768.0f);
+  }
+}
+
+// Bin with the most power above DC, refined by fitting a parabola to the
+// log power around it.
+static float dominant_frequency(const Job *job, const float power[], float *level_db) {
+  unsigned bins = job->fft_size / 2;
+  unsigned best = 1;
+  for (unsigned k = 2; k < bins; k++) {
+    if (power[k] > power[best]) { best = k; }
+  }
+  float a = to_db(power[best - 1]), b = to_db(power[best]), c = to_db(power[best + 1]);
+  float denom = a - 2.0f * b + c;
+  float offset = denom < 0.0f ? 0.5f * (a - c) / denom : 0.0f;
+  *level_db = b;
+  return (best + offset) * job->format.sample_rate / job->fft_size;
+}
+
+static void *analyze_columns(void *arg) {
+  Job *job = arg;
+  const unsigned n = job->fft_size;
+  const unsigned bins = n / 2 + 1;
+
+  FILE *in = fopen(job->filename, "rb");
+  if (!in) {
+    fatal_error("Unable to open input file");
+  }
+
+  unsigned max_len = (FRAMES_PER_READ - 1) * job->hop + n;
+  unsigned char *scratch = malloc(CONVERT_SCRATCH_BYTES);
+  int16_t *stereo = malloc(max_len * NUM_CHANNELS * sizeof(int16_t));
+  float *mono  = malloc(max_len * sizeof(float));
+  float *re    = malloc(n * sizeof(float));
+  float *im    = malloc(n * sizeof(float));
+  float *power = malloc(2 * bins * sizeof(float));
+  if (!scratch || !stereo || !mono || !re || !im || !power) {
+    fatal_error("Out of memory in analysis thread");
+  }
+
+  unsigned first = column_start(job, job->first_column);
+  unsigned end = column_start(job, job->end_column);
+  unsigned column = job->first_column;
+
+  // Frames always share an FFT in pairs (2k, 2k+1), so the results don't
+  // depend on how the frames are split across threads: start on an even
+  // frame and end after an odd one, analyzing the extra frame at either
+  // end only as the other half of its pair.
+  unsigned read_first = first & ~1u;
+  unsigned read_end = (end & 1u) && end < job->num_frames ? end + 1 : end;
+
+  for (unsigned f0 = read_first; f0 < read_end; f0 += FRAMES_PER_READ) {
+    unsigned count = read_end - f0 < FRAMES_PER_READ ? read_end - f0 : FRAMES_PER_READ;
+    read_frames(in, job, f0, count, scratch, stereo, mono);
+
+    // two real frames per complex FFT: one in re, the next in im
+    for (unsigned i = 0; i < count; i += 2) {
+      const float *x0 = mono + i * job->hop;
+      const float *x1 = i + 1 < count ? x0 + job->hop : NULL;
+      for (unsigned t = 0; t < n; t++) {
+        re[t] = x0[t] * job->window[t];
+        im[t] = x1 ? x1[t] * job->window[t] : 0.0f;
+      }
+      fft_forward(job->plan, re, im);
+
+      // separate the two spectra: X0[k] = (Z[k] + conj Z[n-k]) / 2,
+      // X1[k] = (Z[k] - conj Z[n-k]) / 2i
+      for (unsigned k = 0; k < bins; k++) {
+        unsigned m = (n - k) & (n - 1);
+        float r0 = 0.5f * (re[k] + re[m]), i0 = 0.5f * (im[k] - im[m]);
+        float r1 = 0.5f * (im[k] + im[m]), i1 = 0.5f * (re[m] - re[k]);
+        power[k] = (r0 * r0 + i0 * i0) * job->power_scale;
+        power[bins + k] = (r1 * r1 + i1 * i1) * job->power_scale;
+      }
+
+      for (unsigned j = 0; j < 2 && i + j < count; j++) {
+        const float *p = power + j * bins;
+        unsigned frame = f0 + i + j;
+        if (frame < first || frame >= end) {
+          continue;
+        }
+        while (column + 1 < job->end_column && frame >= column_start(job, column + 1)) {
+          column++;
+        }
+
+        job->frame_freq[frame] = dominant_frequency(job, p, &job->frame_db[frame]);
+        for (unsigned k = 0; k < bins; k++) {
+          job->power_sum[k] += p[k];
+        }
+
+        // each pixel keeps the loudest bin among the frames and bins it covers
+        if (job->image) {
+          float *col = job->image + column;
+          for (unsigned r = 0; r < job->height; r++) {
+            unsigned k0 = (unsigned) ((uint64_t) (bins - 1) * r / job->height) + 1;
+            unsigned k1 = (unsigned) ((uint64_t) (bins - 1) * (r + 1) / job->height) + 1;
+            float best = p[k0];
+            for (unsigned k = k0 + 1; k < k1; k++) {
+              if (p[k] > best) { best = p[k]; }
+            }
+            float db = to_db(best);
+            if (db > col[r * job->width]) { col[r * job->width] = db; }
+          }
+        }
+      }
+    }
+  }
+
+  fclose(in);
+  free(scratch);
+  free(stereo);
+  free(mono);
+  free(re);
+  free(im);
+  free(power);
+  return NULL;
+}
+
+static void write_spectrogram(const char *filename, const float image[], unsigned width, unsigned height) {
+  FILE *out = fopen(filename, "wb");
+  if (!out) {
+    fatal_error("Unable to open spectrogram file");
+  }
+
+  // find the loudest pixel and map the IMAGE_RANGE_DB below it to 0..255
+  float top = FLOOR_DB;
+  for (unsigned i = 0; i < width * height; i++) {
+    if (image[i] > top) { top = image[i]; }
+  }
+
+  fprintf(out, "P5\n%u %u\n255\n", width, height);
+  unsigned char *row = malloc(width);
+  if (!row) { fatal_error("Out of memory writing spectrogram"); }
+  for (unsigned r = height; r-- > 0; ) { // highest frequency at the top
+    for (unsigned c = 0; c < width; c++) {
+      float v = (image[r * width + c] - (top - IMAGE_RANGE_DB)) * (255.0f / IMAGE_RANGE_DB);
+      row[c] = v < 0.0f ? 0 : v > 255.0f ? 255 : (unsigned char) v;
+    }
+    write_bytes(out, (const char *) row, width);
+  }
+  free(row);
+  fclose(out);
+}
+
+static const char *NOTE_NAMES[12] = { "C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B" };
+
+// Print the strongest local maxima of the average spectrum, with the
+// nearest MIDI note and how far off it they are in cents.
+static void print_spectral_peaks(const double power_sum[], unsigned bins, unsigned fft_size,
+                                 unsigned sample_rate, unsigned num_frames, unsigned num_peaks) {
+  unsigned *peaks = malloc(num_peaks * sizeof(unsigned));
+  unsigned found = 0;
+  if (!peaks) { fatal_error("Out of memory finding peaks"); }
+
+  for (unsigned k = 2; k + 1 < bins; k++) {
+    if (power_sum[k] <= power_sum[k - 1] || power_sum[k] < power_sum[k + 1]) {
+      continue;
+    }
+    // insert into the sorted list of the strongest peaks so far
+    unsigned pos = found < num_peaks ? found++ : num_peaks;
+    while (pos > 0 && power_sum[peaks[pos - 1]] < power_sum[k]) {
+      if (pos < num_peaks) { peaks[pos] = peaks[pos - 1]; }
+      pos--;
+    }
+    if (pos < num_peaks) { peaks[pos] = k; }
+  }
+
+  printf("spectral peaks:\n");
+  for (unsigned i = 0; i < found; i++) {
+    unsigned k = peaks[i];
+    double a = 10.0 * log10(power_sum[k - 1] / num_frames + 1e-20);
+    double b = 10.0 * log10(power_sum[k] / num_frames + 1e-20);
+    double c = 10.0 * log10(power_sum[k + 1] / num_frames + 1e-20);
+    double denom = a - 2.0 * b + c;
+    double offset = denom < 0.0 ? 0.5 * (a - c) / denom : 0.0;
+    double freq = (k + offset) * sample_rate / fft_size;
+    double midi = 69.0 + 12.0 * log2(freq / 440.0);
+    int note = (int) floor(midi + 0.5);
+    char name[16];
+    snprintf(name, sizeof(name), "%s%d", NOTE_NAMES[((note % 12) + 12) % 12], note / 12 - 1);
+    printf("  %10.2f Hz  %7.1f dB  %-4s (MIDI %3d) %+6.1f cents\n", freq, b, name, note, 100.0 * (midi - note));
+  }
+  free(peaks);
+}
+
+static unsigned parse_count(const char *flag, const char *value) {
+  int v;
+  if (!value || sscanf(value, "%d", &v) != 1 || v <= 0) {
+    fprintf(stderr, "Error: %s requires a positive number\n", flag);
+    exit(1);
+  }
+  return (unsigned) v;
+}
+
+int main(int argc, char* argv[]) {
+  unsigned fft_size = 2048, hop = 1024, num_threads = 0, num_peaks = 8;
+  unsigned width = 1024, height = 256;
+  const char *framesfile = NULL, *imagefile = NULL, *wavfilein = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+    if (strcmp(argv[i], "--fft") == 0)              { fft_size = parse_count(argv[i++], value); }
+    else if (strcmp(argv[i], "--hop") == 0)         { hop = parse_count(argv[i++], value); }
+    else if (strcmp(argv[i], "--threads") == 0)     { num_threads = parse_count(argv[i++], value); }
+    else if (strcmp(argv[i], "--num-peaks") == 0)   { num_peaks = parse_count(argv[i++], value); }
+    else if (strcmp(argv[i], "--width") == 0)       { width = parse_count(argv[i++], value); }
+    else if (strcmp(argv[i], "--height") == 0)      { height = parse_count(argv[i++], value); }
+    else if (strcmp(argv[i], "--frames") == 0 && value)      { framesfile = argv[++i]; }
+    else if (strcmp(argv[i], "--spectrogram") == 0 && value) { imagefile = argv[++i]; }
+    else if (!wavfilein && argv[i][0] != '-')       { wavfilein = argv[i]; }
+    else { fatal_error("usage: analyze_wave [--fft N] [--hop N] [--threads N] [--num-peaks N] "
+                       "[--frames FILE] [--spectrogram FILE.pgm] [--width W] [--height H] in.wav"); }
+  }
+  if (!wavfilein) {
+    fatal_error("No input file given");
+  }
+  if (fft_size < 4) {
+    fatal_error("FFT size must be at least 4");
+  }
+  if (num_threads == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = cpus > 0 ? (unsigned) cpus : 1u;
+  }
+
+  // Header tells us the length and where the samples start
+  FILE* fp_r = fopen(wavfilein, "rb");
+  if (!fp_r) {
+    fatal_error("Unable to open file");
+  }
+  WaveFormat format;
+  unsigned num_samples;
+  read_wave_format(fp_r, &format, &num_samples);
+  long data_offset = ftell(fp_r);
+  fclose(fp_r);
+
+  FFTPlan plan;
+  fft_plan_init(&plan, fft_size);
+  const unsigned bins = fft_size / 2 + 1;
+
+  float *window = malloc(fft_size * sizeof(float));
+  if (!window) { fatal_error("Out of memory"); }
+  for (unsigned t = 0; t < fft_size; t++) {
+    window[t] = 0.5f - 0.5f * cosf(2.0f * (float) PI * t / fft_size);
+  }
+
+  Job base;
+  memset(&base, 0, sizeof(base));
+  base.filename = wavfilein;
+  base.data_offset = data_offset;
+  base.format = format;
+  base.num_samples = num_samples;
+  base.fft_size = fft_size;
+  base.hop = hop;
+  base.num_frames = num_samples >= fft_size ? 1 + (num_samples - fft_size) / hop : 0;
+  base.width = width < base.num_frames ? width : base.num_frames;
+  base.height = height < bins - 1 ? height : bins - 1;
+  base.plan = &plan;
+  base.window = window;
+  base.power_scale = 16.0f / ((float) fft_size * fft_size);
+
+  base.frame_freq = malloc((base.num_frames + 1) * sizeof(float));
+  base.frame_db   = malloc((base.num_frames + 1) * sizeof(float));
+  if (!base.frame_freq || !base.frame_db) { fatal_error("Out of memory"); }
+  if (imagefile && base.width > 0) {
+    base.image = malloc((size_t) base.width * base.height * sizeof(float));
+    if (!base.image) { fatal_error("Out of memory"); }
+    for (size_t i = 0; i < (size_t) base.width * base.height; i++) {
+      base.image[i] = FLOOR_DB;
+    }
+  }
+
+  // Split the spectrogram columns (and so the frames) across threads.
+  // Input shorter than one FFT frame has no columns and needs no threads.
+  if (num_threads > base.width) {
+    num_threads = base.width;
+  }
+  Job *jobs = malloc((num_threads + 1) * sizeof(Job));
+  pthread_t *threads = malloc((num_threads + 1) * sizeof(pthread_t));
+  if (!jobs || !threads) { fatal_error("Out of memory"); }
+  for (unsigned t = 0; t < num_threads; t++) {
+    jobs[t] = base;
+    jobs[t].first_column = (unsigned) ((uint64_t) base.width * t / num_threads);
+    jobs[t].end_column = (unsigned) ((uint64_t) base.width * (t + 1) / num_threads);
+    jobs[t].power_sum = calloc(bins, sizeof(double));
+    if (!jobs[t].power_sum) { fatal_error("Out of memory"); }
+    if (pthread_create(&threads[t], NULL, analyze_columns, &jobs[t]) != 0) {
+      fatal_error("Could not start analysis thread");
+    }
+  }
+
+  double *power_sum = calloc(bins, sizeof(double));
+  if (!power_sum) { fatal_error("Out of memory"); }
+  for (unsigned t = 0; t < num_threads; t++) {
+    pthread_join(threads[t], NULL);
+    for (unsigned k = 0; k < bins; k++) {
+      power_sum[k] += jobs[t].power_sum[k];
+    }
+    free(jobs[t].power_sum);
+  }
+
+  printf("%s: %u samples, %u frames (fft %u, hop %u, %u threads)\n",
+         wavfilein, num_samples, base.num_frames, fft_size, hop, num_threads);
+  if (base.num_frames > 0) {
+    print_spectral_peaks(power_sum, bins, fft_size, format.sample_rate, base.num_frames, num_peaks);
+  }
+
+  if (framesfile) {
+    FILE *fp_f = fopen(framesfile, "w");
+    if (!fp_f) {
+      fatal_error("Unable to open frames file");
+    }
+    fprintf(fp_f, "# time_s dominant_hz level_db\n");
+    for (unsigned f = 0; f < base.num_frames; f++) {
+      fprintf(fp_f, "%.4f %.2f %.1f\n", (double) f * hop / format.sample_rate,
+              base.frame_freq[f], base.frame_db[f]);
+    }
+    fclose(fp_f);
+  }
+
+  if (base.image) {
+    write_spectrogram(imagefile, base.image, base.width, base.height);
+  }
+
+  fft_plan_free(&plan);
+  free(window);
+  free(base.frame_freq);
+  free(base.frame_db);
+  free(base.image);
+  free(jobs);
+  free(threads);
+  free(power_sum);
+  return 0;
+}
@@ -0,0 +1,143 @@
+#include "io.h"
+#include "convert.h"
+
+// Each to_s16 kernel converts n samples (not frames)
+
+static void u8_to_s16(const unsigned char *restrict src, int16_t *restrict dst, unsigned n) {
+  for (unsigned i = 0; i < n; i++) {
+    dst[i] = (int16_t) ((src[i] - 128) * 256);
+  }
+}
+
+static void s16_to_s16(const unsigned char *restrict src, int16_t *restrict dst, unsigned n) {
+  memcpy(dst, src, n * sizeof(int16_t));
+}
+
+static void s24_to_s16(const unsigned char *restrict src, int16_t *restrict dst, unsigned n) {
+  for (unsigned i = 0; i < n; i++) {
+    dst[i] = (int16_t) (src[3 * i + 1] | (src[3 * i + 2] << 8));
+  }
+}
+
+static void s32_to_s16(const unsigned char *restrict src, int16_t *restrict dst, unsigned n) {
+  for (unsigned i = 0; i < n; i++) {
+    dst[i] = (int16_t) (src[4 * i + 2] | (src[4 * i + 3] << 8));
+  }
+}
+
+static void f32_to_s16(const unsigned char *restrict src, int16_t *restrict dst, unsigned n) {
+  for (unsigned i = 0; i < n; i++) {
+    float x;
+    memcpy(&x, src + 4 * i, sizeof(float));
+    x *= 32768.0f;
+    x = x > INT16_MAX ? INT16_MAX : x;
+    x = x < INT16_MIN ? INT16_MIN : x;
+    dst[i] = x == x ? (int16_t) x : 0; // NaN gets past both clamps; read it as silence
+  }
+}
+
+void convert_to_internal(const WaveFormat *fmt, const unsigned char src[],
+                         int16_t stereo_buf[], unsigned num_frames) {
+  unsigned n = num_frames * fmt->num_channels;
+
+  if (fmt->format == WAVE_FORMAT_IEEE_FLOAT) {
+    f32_to_s16(src, stereo_buf, n);
+  } else {
+    switch (fmt->bits_per_sample) {
+      case 8:  u8_to_s16(src, stereo_buf, n);  break;
+      case 16: s16_to_s16(src, stereo_buf, n); break;
+      case 24: s24_to_s16(src, stereo_buf, n); break;
+      case 32: s32_to_s16(src, stereo_buf, n); break;
+      default: fatal_error("Unsupported sample format");
+    }
+  }
+
+  // spread mono out to both channels, back to front so it can be in place
+  if (fmt->num_channels == 1) {
+    for (unsigned i = num_frames; i-- > 0; ) {
+      stereo_buf[2 * i + 1] = stereo_buf[i];
+      stereo_buf[2 * i] = stereo_buf[i];
+    }
+  }
+}
+
+void convert_from_internal(const WaveFormat *fmt, const int16_t stereo_buf[],
+                           unsigned char dst[], unsigned num_frames) {
+  const unsigned n = num_frames * NUM_CHANNELS;
+  const int16_t *restrict src = stereo_buf;
+  unsigned char *restrict out = dst;
+
+  if (fmt->num_channels != NUM_CHANNELS) {
+    fatal_error("Only stereo output is supported");
+  }
+
+  if (fmt->format == WAVE_FORMAT_IEEE_FLOAT) {
+    for (unsigned i = 0; i < n; i++) {
+      float x = src[i] * (1.0f / 32768.0f);
+      memcpy(out + 4 * i, &x, sizeof(float));
+    }
+    return;
+  }
+
+  switch (fmt->bits_per_sample) {
+    case 8:
+      for (unsigned i = 0; i < n; i++) {
+        out[i] = (unsigned char) ((src[i] >> 8) + 128);
+      }
+      break;
+    case 16:
+      memcpy(out, src, n * sizeof(int16_t));
+      break;
+    case 24:
+      for (unsigned i = 0; i < n; i++) {
+        out[3 * i] = 0;
+        out[3 * i + 1] = (unsigned char) (src[i] & 0xff);
+        out[3 * i + 2] = (unsigned char) ((src[i] >> 8) & 0xff);
+      }
+      break;
+    case 32:
+      for (unsigned i = 0; i < n; i++) {
+        out[4 * i] = 0;
+        out[4 * i + 1] = 0;
+        out[4 * i + 2] = (unsigned char) (src[i] & 0xff);
+        out[4 * i + 3] = (unsigned char) ((src[i] >> 8) & 0xff);
+      }
+      break;
+    default:
+      fatal_error("Unsupported sample format");
+  }
+}
+
+void read_converted(FILE *in, const WaveFormat *fmt, int16_t stereo_buf[], unsigned num_frames,
+                    unsigned char scratch[]) {
+  assert(fmt->block_align <= CONVERT_SCRATCH_BYTES / CONVERT_BLOCK_FRAMES);
+
+  for (unsigned start = 0; start < num_frames; start += CONVERT_BLOCK_FRAMES) {
+    unsigned n = num_frames - start;
+    if (n > CONVERT_BLOCK_FRAMES) { n = CONVERT_BLOCK_FRAMES; }
+    if (fread(scratch, fmt->block_align, n, in) != n) {
+      fatal_error("Number of values and stereo samples are unequal in .wav file");
+    }
+    convert_to_internal(fmt, scratch, stereo_buf + NUM_CHANNELS * start, n);
+  }
+}
+
+int parse_sample_format(const char *name, WaveFormat *fmt) {
+  *fmt = INTERNAL_FORMAT;
+  if (strcmp(name, "u8") == 0) {
+    fmt->bits_per_sample = 8u;
+  } else if (strcmp(name, "s16") == 0) {
+    fmt->bits_per_sample = 16u;
+  } else if (strcmp(name, "s24") == 0) {
+    fmt->bits_per_sample = 24u;
+  } else if (strcmp(name, "s32") == 0) {
+    fmt->bits_per_sample = 32u;
+  } else if (strcmp(name, "f32") == 0) {
+    fmt->format = WAVE_FORMAT_IEEE_FLOAT;
+    fmt->bits_per_sample = 32u;
+  } else {
+    return 0;
+  }
+  fmt->block_align = NUM_CHANNELS * (fmt->bits_per_sample/8u);
+  return 1;
+}
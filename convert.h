@@ -0,0 +1,43 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "wave.h"
+
+// Conversion between WAVE sample formats and the internal interleaved
+// 16-bit stereo format. Each format has its own simple loop over plain
+// arrays so the compiler can vectorize it.
+//
+// To 16 bits, wider samples keep their top 16 bits, 8-bit samples are
+// shifted up, float is scaled and clamped, and mono is copied to both
+// channels. Sample data is assumed to be little-endian, like the host.
+
+// Frames converted per read by read_converted
+#define CONVERT_BLOCK_FRAMES 4096u
+
+// Size of the scratch buffer read_converted needs: a block of the widest
+// supported frames (stereo, 32 bits)
+#define CONVERT_SCRATCH_BYTES (CONVERT_BLOCK_FRAMES * 8u)
+
+// Convert num_frames frames of raw data in fmt to interleaved 16-bit stereo.
+void convert_to_internal(const WaveFormat *fmt, const unsigned char src[],
+                         int16_t stereo_buf[], unsigned num_frames);
+
+// Convert num_frames frames of interleaved 16-bit stereo to raw data in
+// fmt, which must be stereo.
+void convert_from_internal(const WaveFormat *fmt, const int16_t stereo_buf[],
+                           unsigned char dst[], unsigned num_frames);
+
+// Read num_frames frames of data in fmt from in, converting them to
+// interleaved 16-bit stereo as they are read, CONVERT_BLOCK_FRAMES at a time.
+// scratch holds the raw data and must be CONVERT_SCRATCH_BYTES long, so
+// callers reading repeatedly can allocate it once.
+void read_converted(FILE *in, const WaveFormat *fmt, int16_t stereo_buf[], unsigned num_frames,
+                    unsigned char scratch[]);
+
+// Set fmt from a name: u8, s16, s24, s32 or f32 (stereo, 44.1 kHz).
+// Returns 0 if the name is unknown.
+int parse_sample_format(const char *name, WaveFormat *fmt);
+
+#endif // CONVERT_H
@@ -0,0 +1,75 @@
+#include "io.h"
+#include "wave.h"
+#include "fft.h"
+
+void fft_plan_init(FFTPlan *plan, unsigned n) {
+  unsigned log2n = 0;
+  while ((1u << log2n) < n) {
+    log2n++;
+  }
+  if (n < 2 || (1u << log2n) != n) {
+    fatal_error("FFT size must be a power of two");
+  }
+
+  plan->n = n;
+  plan->bitrev = malloc(n * sizeof(unsigned));
+  plan->tw_re = malloc(n * sizeof(float));
+  plan->tw_im = malloc(n * sizeof(float));
+  if (!plan->bitrev || !plan->tw_re || !plan->tw_im) {
+    fatal_error("Out of memory creating FFT plan");
+  }
+
+  for (unsigned i = 0; i < n; i++) {
+    unsigned r = 0;
+    for (unsigned b = 0; b < log2n; b++) {
+      r |= ((i >> b) & 1u) << (log2n - 1 - b);
+    }
+    plan->bitrev[i] = r;
+  }
+
+  // e^(-i pi j / h) for each stage's half-size h
+  plan->tw_re[0] = plan->tw_im[0] = 0.0f;
+  for (unsigned h = 1; h < n; h <<= 1) {
+    for (unsigned j = 0; j < h; j++) {
+      plan->tw_re[h + j] = (float) cos(PI * j / h);
+      plan->tw_im[h + j] = (float) -sin(PI * j / h);
+    }
+  }
+}
+
+void fft_plan_free(FFTPlan *plan) {
+  free(plan->bitrev);
+  free(plan->tw_re);
+  free(plan->tw_im);
+}
+
+void fft_forward(const FFTPlan *plan, float *re, float *im) {
+  const unsigned n = plan->n;
+
+  for (unsigned i = 0; i < n; i++) {
+    unsigned r = plan->bitrev[i];
+    if (r > i) {
+      float t = re[i]; re[i] = re[r]; re[r] = t;
+      t = im[i]; im[i] = im[r]; im[r] = t;
+    }
+  }
+
+  for (unsigned h = 1; h < n; h <<= 1) {
+    const float *restrict wr = plan->tw_re + h;
+    const float *restrict wi = plan->tw_im + h;
+    for (unsigned base = 0; base < n; base += 2 * h) {
+      float *restrict ar = re + base;
+      float *restrict ai = im + base;
+      float *restrict br = re + base + h;
+      float *restrict bi = im + base + h;
+      for (unsigned j = 0; j < h; j++) {
+        float tr = br[j] * wr[j] - bi[j] * wi[j];
+        float ti = br[j] * wi[j] + bi[j] * wr[j];
+        br[j] = ar[j] - tr;
+        bi[j] = ai[j] - ti;
+        ar[j] += tr;
+        ai[j] += ti;
+      }
+    }
+  }
+}
@@ -0,0 +1,25 @@
+#ifndef FFT_H
+#define FFT_H
+
+// In-place radix-2 complex FFT on split real/imaginary arrays.
+//
+// Twiddle factors are stored contiguously per stage, so the innermost
+// butterfly loop walks plain float arrays with unit stride and can be
+// vectorized by the compiler.
+
+typedef struct {
+  unsigned n;
+  unsigned *bitrev; // bit-reversal permutation
+  float *tw_re;     // stage with half-size h uses tw_re[h .. 2h-1]
+  float *tw_im;
+} FFTPlan;
+
+// n must be a power of two, at least 2.
+void fft_plan_init(FFTPlan *plan, unsigned n);
+void fft_plan_free(FFTPlan *plan);
+
+// Forward transform of plan->n points, in place. A plan may be shared
+// between threads; it is only read.
+void fft_forward(const FFTPlan *plan, float *re, float *im);
+
+#endif // FFT_H
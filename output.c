@@ -0,0 +1,277 @@
+#include "io.h"
+#include "output.h"
+#include "convert.h"
+
+static float parse_level(const char *flag, const char *value) {
+  float level;
+  if (!value || sscanf(value, "%f", &level) != 1 || level <= 0.0f) {
+    fprintf(stderr, "Error: %s requires a positive level\n", flag);
+    exit(1);
+  }
+  return level;
+}
+
+void parse_output_options(int *argc, char *argv[], OutputOptions *opts) {
+  opts->limit = 1;
+  opts->ceiling = 1.0f;
+  opts->normalize = NORMALIZE_NONE;
+  opts->target = 1.0f;
+  opts->peaks_path = NULL;
+  opts->format = INTERNAL_FORMAT;
+
+  int j = 1;
+  for (int i = 1; i < *argc; i++) {
+    const char *value = i + 1 < *argc ? argv[i + 1] : NULL;
+    if (strcmp(argv[i], "--peaks") == 0) {
+      if (!value) { fatal_error("--peaks requires a file name"); }
+      opts->peaks_path = value;
+      i++;
+    } else if (strcmp(argv[i], "--format") == 0) {
+      if (!value || !parse_sample_format(value, &opts->format)) {
+        fatal_error("--format requires one of u8, s16, s24, s32, f32");
+      }
+      i++;
+    } else if (strcmp(argv[i], "--no-limit") == 0) {
+      opts->limit = 0;
+    } else if (strcmp(argv[i], "--ceiling") == 0) {
+      opts->ceiling = parse_level(argv[i], value);
+      i++;
+    } else if (strcmp(argv[i], "--normalize-peak") == 0) {
+      opts->normalize = NORMALIZE_PEAK;
+      opts->target = parse_level(argv[i], value);
+      i++;
+    } else if (strcmp(argv[i], "--normalize-rms") == 0) {
+      opts->normalize = NORMALIZE_RMS;
+      opts->target = parse_level(argv[i], value);
+      i++;
+    } else {
+      argv[j++] = argv[i];
+    }
+  }
+  *argc = j;
+  argv[j] = NULL;
+}
+
+float output_gain(const int32_t stereo_bus[], unsigned num_frames, const OutputOptions *opts) {
+  OutputMeter m;
+  output_meter_init(&m);
+  output_meter_add(&m, stereo_bus, num_frames);
+  return output_meter_gain(&m, opts);
+}
+
+void output_meter_init(OutputMeter *m) {
+  m->peak = 0;
+  m->sum_sq = 0.0;
+  m->num_frames = 0;
+}
+
+void output_meter_add(OutputMeter *m, const int32_t stereo_bus[], unsigned num_frames) {
+  for (unsigned i = 0; i < num_frames * NUM_CHANNELS; i++) {
+    int32_t mag = stereo_bus[i] < 0 ? -stereo_bus[i] : stereo_bus[i];
+    if (mag > m->peak) { m->peak = mag; }
+    m->sum_sq += (double) stereo_bus[i] * stereo_bus[i];
+  }
+  m->num_frames += num_frames;
+}
+
+float output_meter_gain(const OutputMeter *m, const OutputOptions *opts) {
+  double level = 0.0;
+
+  if (opts->normalize == NORMALIZE_PEAK) {
+    level = m->peak;
+  } else if (opts->normalize == NORMALIZE_RMS) {
+    level = m->num_frames ? sqrt(m->sum_sq / (m->num_frames * NUM_CHANNELS)) : 0.0;
+  }
+
+  if (level <= 0.0) {
+    return 1.0f;
+  }
+  return (float) (opts->target * INT16_MAX / level);
+}
+
+void output_open(OutputStage *os, const char *filename, unsigned num_frames,
+                 float gain, const OutputOptions *opts, int with_peaks) {
+  os->out = fopen(filename, "wb");
+  if (!os->out) {
+    fatal_error("error opening output file");
+  }
+  os->format = opts->format;
+  write_wave_format(os->out, &os->format, num_frames);
+
+  os->gain = gain;
+  os->limit = opts->limit;
+  limiter_init(&os->limiter, LIMITER_LOOKAHEAD_FRAMES, opts->ceiling);
+  os->leader = NULL;
+  os->peaks_path = with_peaks ? opts->peaks_path : NULL;
+  if (os->peaks_path) {
+    peak_builder_init(&os->peaks);
+  }
+
+  os->block_len = 0;
+}
+
+static void flush_block(OutputStage *os) {
+  PeakBuilder *peaks = os->peaks_path ? &os->peaks : NULL;
+  if (os->format.format == WAVE_FORMAT_PCM && os->format.bits_per_sample == BITS_PER_SAMPLE) {
+    write_wave_data(os->out, os->block, os->block_len, peaks);
+  } else {
+    convert_from_internal(&os->format, os->block, os->raw, os->block_len);
+    write_bytes(os->out, (const char *) os->raw, os->block_len * os->format.block_align);
+    if (peaks) {
+      peak_builder_add(peaks, os->block, os->block_len);
+    }
+  }
+  os->block_len = 0;
+}
+
+int16_t clip_sample(float sample) {
+  float s = roundf(sample);
+  if (s > INT16_MAX) { // clipping, for when the limiter is off
+    s = INT16_MAX;
+  } else if (s < INT16_MIN) {
+    s = INT16_MIN;
+  }
+  return (int16_t) s;
+}
+
+static void emit_frame(OutputStage *os, const float frame[], float gain) {
+  for (unsigned c = 0; c < NUM_CHANNELS; c++) {
+    os->block[NUM_CHANNELS * os->block_len + c] = clip_sample(frame[c] * gain);
+  }
+  if (++os->block_len == OUTPUT_BLOCK_FRAMES) {
+    flush_block(os);
+  }
+}
+
+void limiter_init(Limiter *lim, unsigned lookahead, float ceiling) {
+  assert(lookahead >= 1 && lookahead <= LIMITER_LOOKAHEAD_FRAMES);
+  lim->lookahead = lookahead;
+  lim->ceiling_level = ceiling * INT16_MAX;
+  lim->num_in = 0;
+  lim->min_head = 0;
+  lim->min_len = 0;
+  for (unsigned i = 0; i < lookahead; i++) {
+    lim->hold[i] = 1.0f;
+  }
+  lim->hold_sum = lookahead;
+}
+
+// Each frame needs gain g[n] <= ceiling / |x[n]|. The held gain h[n] is the
+// minimum of g over the last L frames, and the applied gain is the mean of
+// the last L held gains. Every term of that mean covers the frame being
+// emitted, so the applied gain never exceeds what that frame needs, while
+// changing smoothly over L frames on either side of a peak.
+int limiter_delay(Limiter *lim, const float in[], float out[]) {
+  const unsigned L = lim->lookahead;
+  uint64_t n = lim->num_in++;
+
+  for (unsigned c = 0; c < NUM_CHANNELS; c++) {
+    lim->delay[NUM_CHANNELS * (n % L) + c] = in[c];
+  }
+  if (n + 1 < L) {
+    return 0;
+  }
+  for (unsigned c = 0; c < NUM_CHANNELS; c++) {
+    out[c] = lim->delay[NUM_CHANNELS * ((n + 1) % L) + c];
+  }
+  return 1;
+}
+
+int limiter_push(Limiter *lim, const float in[], float out[], float *gain) {
+  const unsigned L = lim->lookahead;
+  uint64_t n = lim->num_in++;
+  unsigned slot = n % L;
+
+  float peak = 0.0f;
+  for (unsigned c = 0; c < NUM_CHANNELS; c++) {
+    lim->delay[NUM_CHANNELS * slot + c] = in[c];
+    if (fabsf(in[c]) > peak) { peak = fabsf(in[c]); }
+  }
+  float g = peak > lim->ceiling_level ? lim->ceiling_level / peak : 1.0f;
+
+  // sliding minimum of g over frames n-L+1..n
+  if (lim->min_len > 0 && lim->min_idx[lim->min_head] + L <= n) {
+    lim->min_head = (lim->min_head + 1) % L;
+    lim->min_len--;
+  }
+  while (lim->min_len > 0 && lim->min_val[(lim->min_head + lim->min_len - 1) % L] >= g) {
+    lim->min_len--;
+  }
+  lim->min_val[(lim->min_head + lim->min_len) % L] = g;
+  lim->min_idx[(lim->min_head + lim->min_len) % L] = n;
+  lim->min_len++;
+  float held = lim->min_val[lim->min_head];
+
+  lim->hold_sum += held - lim->hold[slot];
+  lim->hold[slot] = held;
+
+  if (n + 1 < L) {
+    return 0;
+  }
+  const float *delayed = &lim->delay[NUM_CHANNELS * ((n + 1) % L)];
+  for (unsigned c = 0; c < NUM_CHANNELS; c++) {
+    out[c] = delayed[c];
+  }
+  *gain = (float) (lim->hold_sum / L);
+  return 1;
+}
+
+void output_follow(OutputStage *os, const OutputStage *leader) {
+  os->leader = leader;
+}
+
+// Feed one frame to the stage's limiter as step number step of the current
+// call, emitting the delayed frame if any.
+static void limit_frame(OutputStage *os, const float frame[], unsigned step) {
+  float delayed[NUM_CHANNELS], gain = 1.0f;
+  if (os->leader) {
+    assert(step < OUTPUT_BLOCK_FRAMES);
+    if (limiter_delay(&os->limiter, frame, delayed)) {
+      emit_frame(os, delayed, os->leader->step_gain[step]);
+    }
+    return;
+  }
+  if (limiter_push(&os->limiter, frame, delayed, &gain)) {
+    emit_frame(os, delayed, gain);
+  }
+  if (step < OUTPUT_BLOCK_FRAMES) {
+    os->step_gain[step] = gain;
+  }
+}
+
+void output_write(OutputStage *os, const int32_t stereo_bus[], unsigned num_frames) {
+  float frame[NUM_CHANNELS];
+  for (unsigned i = 0; i < num_frames; i++) {
+    for (unsigned c = 0; c < NUM_CHANNELS; c++) {
+      frame[c] = stereo_bus[NUM_CHANNELS * i + c] * os->gain;
+    }
+    if (os->limit) {
+      limit_frame(os, frame, i);
+    } else {
+      emit_frame(os, frame, 1.0f);
+    }
+  }
+}
+
+void output_close(OutputStage *os) {
+  if (os->limit) {
+    // push silence through to drain the lookahead
+    float silence[NUM_CHANNELS] = { 0.0f };
+    for (unsigned i = 0; i + 1 < LIMITER_LOOKAHEAD_FRAMES; i++) {
+      limit_frame(os, silence, i);
+    }
+  }
+  flush_block(os);
+  if (os->peaks_path) {
+    peak_builder_finish(&os->peaks, os->peaks_path);
+  }
+  fclose(os->out);
+}
+
+void write_output(const char *filename, const int32_t stereo_bus[], unsigned num_frames,
+                  const OutputOptions *opts) {
+  OutputStage os;
+  output_open(&os, filename, num_frames, output_gain(stereo_bus, num_frames, opts), opts, 1);
+  output_write(&os, stereo_bus, num_frames);
+  output_close(&os);
+}
@@ -0,0 +1,127 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "wave.h"
+#include "peak.h"
+
+// Final output stage shared by the render tools. Tools mix into a wide
+// (int32_t) stereo bus so nothing clips while mixing; the output stage
+// then applies a normalization gain, a lookahead peak limiter and the
+// conversion to 16-bit samples while the WAVE file is written, in one pass.
+
+// normalization modes
+#define NORMALIZE_NONE 0
+#define NORMALIZE_PEAK 1
+#define NORMALIZE_RMS  2
+
+// Lookahead of the limiter (about 5.8 ms). Gain reduction ramps in over
+// this many frames before a peak and ramps out over as many after it.
+#define LIMITER_LOOKAHEAD_FRAMES 256u
+
+typedef struct {
+  int limit;              // run the limiter (otherwise hard-clip)
+  float ceiling;          // limiter ceiling, as a fraction of full scale
+  int normalize;          // one of the NORMALIZE_ modes
+  float target;           // normalization target, as a fraction of full scale
+  const char *peaks_path; // companion peak file, or NULL
+  WaveFormat format;      // sample format of the written file
+} OutputOptions;
+
+// Fill in defaults, then take any output options off the command line:
+//   --peaks FILE          also write a peak file
+//   --no-limit            hard-clip instead of limiting
+//   --ceiling X           limiter ceiling (default 1.0)
+//   --normalize-peak X    scale so the loudest sample is X of full scale
+//   --normalize-rms X     scale so the RMS level is X of full scale
+//   --format NAME         write u8, s16 (default), s24, s32 or f32 samples
+// argc is updated to match the remaining arguments.
+void parse_output_options(int *argc, char *argv[], OutputOptions *opts);
+
+// Gain that brings a mixed bus to the normalization target, or 1.0 if
+// normalization is off or the bus is silent.
+float output_gain(const int32_t stereo_bus[], unsigned num_frames, const OutputOptions *opts);
+
+// The same measurement for a bus that is produced a block at a time:
+// add every block, then take the gain.
+typedef struct {
+  int32_t peak;
+  double sum_sq;
+  uint64_t num_frames;
+} OutputMeter;
+
+void output_meter_init(OutputMeter *m);
+void output_meter_add(OutputMeter *m, const int32_t stereo_bus[], unsigned num_frames);
+float output_meter_gain(const OutputMeter *m, const OutputOptions *opts);
+
+// Lookahead peak limiter, usable on its own for streams that don't go to a
+// WAVE file (such as the live server).
+typedef struct {
+  unsigned lookahead;                                 // at most LIMITER_LOOKAHEAD_FRAMES
+  float ceiling_level;
+  uint64_t num_in;                                    // frames taken so far
+  float delay[LIMITER_LOOKAHEAD_FRAMES * NUM_CHANNELS]; // delayed input frames
+  float min_val[LIMITER_LOOKAHEAD_FRAMES];            // sliding-minimum queue
+  uint64_t min_idx[LIMITER_LOOKAHEAD_FRAMES];
+  unsigned min_head, min_len;
+  float hold[LIMITER_LOOKAHEAD_FRAMES];               // recent held gains
+  double hold_sum;
+} Limiter;
+
+// ceiling is a fraction of full scale.
+void limiter_init(Limiter *lim, unsigned lookahead, float ceiling);
+
+// Push one frame of (float) samples. Output lags input by lookahead - 1
+// frames: once that many frames are buffered, returns 1 with the delayed
+// frame in out[] and the gain to apply to it in *gain; otherwise returns 0.
+int limiter_push(Limiter *lim, const float in[], float out[], float *gain);
+
+// Only delay a frame like limiter_push does, without computing any gain,
+// for a stream that follows another limiter's gain.
+int limiter_delay(Limiter *lim, const float in[], float out[]);
+
+// Round a sample to 16 bits, clipping it to range.
+int16_t clip_sample(float sample);
+
+typedef struct OutputStage {
+  FILE *out;
+  float gain;
+  int limit;
+  const char *peaks_path;
+  PeakBuilder peaks;
+  WaveFormat format;
+  Limiter limiter;
+  const struct OutputStage *leader; // follow this stage's limiter gain, or NULL
+  float step_gain[OUTPUT_BLOCK_FRAMES]; // limiter gain applied at each step of
+                                        // the last output_write or output_close
+
+  int16_t block[OUTPUT_BLOCK_FRAMES * NUM_CHANNELS];
+  unsigned block_len;
+  unsigned char raw[OUTPUT_BLOCK_FRAMES * NUM_CHANNELS * 4]; // block in output format
+} OutputStage;
+
+// Open a WAVE file of num_frames frames and write its header. peaks
+// is taken from opts only if with_peaks is nonzero.
+void output_open(OutputStage *os, const char *filename, unsigned num_frames,
+                 float gain, const OutputOptions *opts, int with_peaks);
+
+// Apply the leader's limiter gain, frame for frame, instead of running
+// a limiter of our own, so a set of stems still adds up to a limited mix.
+// Each output_write and output_close of the follower must come right after
+// the same call on the leader, with the same number of frames (at most
+// OUTPUT_BLOCK_FRAMES per write).
+void output_follow(OutputStage *os, const OutputStage *leader);
+
+// Push frames of the mixed bus through the stage. Frames may be pushed
+// in blocks of any size; output is written in OUTPUT_BLOCK_FRAMES blocks.
+void output_write(OutputStage *os, const int32_t stereo_bus[], unsigned num_frames);
+
+// Drain the limiter, finish the peak file and close the WAVE file.
+void output_close(OutputStage *os);
+
+// Convenience for a whole bus: open, normalize, write and close.
+void write_output(const char *filename, const int32_t stereo_bus[], unsigned num_frames,
+                  const OutputOptions *opts);
+
+#endif // OUTPUT_H
@@ -0,0 +1,219 @@
+#include <string.h>
+#include "io.h"
+#include "peak.h"
+
+const unsigned PEAK_FRAMES_PER_BUCKET[PEAK_NUM_LEVELS] = { 256u, 4096u, 65536u, 1048576u };
+
+static void reset_accum(PeakAccum *acc) {
+  acc->frames = 0;
+  for (unsigned c = 0; c < NUM_CHANNELS; c++) {
+    acc->min[c] = INT16_MAX;
+    acc->max[c] = INT16_MIN;
+    acc->sum_sq[c] = 0.0;
+  }
+}
+
+void peak_builder_init(PeakBuilder *pb) {
+  pb->num_frames = 0;
+  for (unsigned l = 0; l < PEAK_NUM_LEVELS; l++) {
+    assert(l == 0 || PEAK_FRAMES_PER_BUCKET[l] % PEAK_FRAMES_PER_BUCKET[l - 1] == 0);
+    reset_accum(&pb->acc[l]);
+    pb->buckets[l] = NULL;
+    pb->num_buckets[l] = 0;
+    pb->capacity[l] = 0;
+  }
+}
+
+// Turn the open bucket at this level into a finished one, and fold it
+// into the next coarser level.
+static void close_bucket(PeakBuilder *pb, unsigned level) {
+  PeakAccum *acc = &pb->acc[level];
+
+  if (pb->num_buckets[level] == pb->capacity[level]) {
+    pb->capacity[level] = pb->capacity[level] ? 2 * pb->capacity[level] : 64u;
+    pb->buckets[level] = realloc(pb->buckets[level], pb->capacity[level] * sizeof(PeakBucket));
+    if (!pb->buckets[level]) { fatal_error("Out of memory building peak file."); }
+  }
+
+  PeakBucket *b = &pb->buckets[level][pb->num_buckets[level]++];
+  for (unsigned c = 0; c < NUM_CHANNELS; c++) {
+    double rms = sqrt(acc->sum_sq[c] / acc->frames);
+    b->min[c] = acc->min[c];
+    b->max[c] = acc->max[c];
+    b->rms[c] = rms > INT16_MAX ? INT16_MAX : (int16_t) rms;
+  }
+
+  if (level + 1 < PEAK_NUM_LEVELS) {
+    PeakAccum *next = &pb->acc[level + 1];
+    next->frames += acc->frames;
+    for (unsigned c = 0; c < NUM_CHANNELS; c++) {
+      if (acc->min[c] < next->min[c]) { next->min[c] = acc->min[c]; }
+      if (acc->max[c] > next->max[c]) { next->max[c] = acc->max[c]; }
+      next->sum_sq[c] += acc->sum_sq[c];
+    }
+    if (next->frames == PEAK_FRAMES_PER_BUCKET[level + 1]) {
+      close_bucket(pb, level + 1);
+    }
+  }
+
+  reset_accum(acc);
+}
+
+void peak_builder_add(PeakBuilder *pb, const int16_t stereo_buf[], unsigned num_frames) {
+  PeakAccum *acc = &pb->acc[0];
+  const unsigned bucket = PEAK_FRAMES_PER_BUCKET[0];
+
+  pb->num_frames += num_frames;
+  for (unsigned i = 0; i < num_frames; i++) {
+    for (unsigned c = 0; c < NUM_CHANNELS; c++) {
+      int16_t s = stereo_buf[NUM_CHANNELS * i + c];
+      if (s < acc->min[c]) { acc->min[c] = s; }
+      if (s > acc->max[c]) { acc->max[c] = s; }
+      acc->sum_sq[c] += (double) s * s;
+    }
+    if (++acc->frames == bucket) {
+      close_bucket(pb, 0);
+    }
+  }
+}
+
+void peak_builder_finish(PeakBuilder *pb, const char *filename) {
+  // flush partial buckets, finest first so each one folds into the next
+  for (unsigned l = 0; l < PEAK_NUM_LEVELS; l++) {
+    if (pb->acc[l].frames > 0) {
+      close_bucket(pb, l);
+    }
+  }
+
+  FILE *out = fopen(filename, "wb");
+  if (!out) {
+    fatal_error("Could not open peak file for writing.");
+  }
+
+  write_bytes(out, "PEAK", 4u);
+  write_u32(out, pb->num_frames);
+  write_u32(out, SAMPLES_PER_SECOND);
+  write_u16(out, NUM_CHANNELS);
+  write_u16(out, PEAK_NUM_LEVELS);
+  for (unsigned l = 0; l < PEAK_NUM_LEVELS; l++) {
+    write_u32(out, PEAK_FRAMES_PER_BUCKET[l]);
+    write_u32(out, pb->num_buckets[l]);
+  }
+  for (unsigned l = 0; l < PEAK_NUM_LEVELS; l++) {
+    for (unsigned i = 0; i < pb->num_buckets[l]; i++) {
+      const PeakBucket *b = &pb->buckets[l][i];
+      for (unsigned c = 0; c < NUM_CHANNELS; c++) {
+        write_s16(out, b->min[c]);
+        write_s16(out, b->max[c]);
+        write_s16(out, b->rms[c]);
+      }
+    }
+    free(pb->buckets[l]);
+    pb->buckets[l] = NULL;
+  }
+
+  fclose(out);
+}
+
+void peak_open(PeakFile *pf, const char *filename) {
+  char label_buf[4];
+  uint32_t val32;
+  uint16_t num_channels, num_levels;
+
+  pf->in = fopen(filename, "rb");
+  if (!pf->in) {
+    fatal_error("Could not open peak file for reading.");
+  }
+
+  read_bytes(pf->in, label_buf, 4u);
+  if (memcmp(label_buf, "PEAK", 4u) != 0) {
+    fatal_error("Bad peak header (no PEAK label)");
+  }
+  read_u32(pf->in, &val32);
+  pf->num_frames = val32;
+  read_u32(pf->in, &val32);
+  pf->sample_rate = val32;
+
+  read_u16(pf->in, &num_channels);
+  if (num_channels != NUM_CHANNELS) {
+    fatal_error("Bad peak header (NumChannels is not 2)");
+  }
+  read_u16(pf->in, &num_levels);
+  if (num_levels != PEAK_NUM_LEVELS) {
+    fatal_error("Bad peak header (unexpected number of levels)");
+  }
+
+  long offset = 4 + 4 + 4 + 2 + 2 + 8L * PEAK_NUM_LEVELS;
+  for (unsigned l = 0; l < PEAK_NUM_LEVELS; l++) {
+    read_u32(pf->in, &val32);
+    if (val32 == 0) {
+      fatal_error("Bad peak header (empty buckets)");
+    }
+    pf->frames_per_bucket[l] = val32;
+    read_u32(pf->in, &val32);
+    pf->num_buckets[l] = val32;
+    pf->offset[l] = offset;
+    offset += (long) pf->num_buckets[l] * sizeof(PeakBucket);
+  }
+}
+
+void peak_close(PeakFile *pf) {
+  fclose(pf->in);
+  pf->in = NULL;
+}
+
+void peak_read_range(PeakFile *pf, unsigned start_frame, unsigned end_frame,
+                     unsigned num_pixels, PeakBucket out[]) {
+  memset(out, 0, num_pixels * sizeof(PeakBucket));
+  if (end_frame > pf->num_frames) { end_frame = pf->num_frames; }
+  if (num_pixels == 0 || start_frame >= end_frame) { return; }
+
+  // coarsest level whose buckets are no wider than a pixel
+  uint64_t span = end_frame - start_frame;
+  unsigned level = 0;
+  while (level + 1 < PEAK_NUM_LEVELS && pf->frames_per_bucket[level + 1] * (uint64_t) num_pixels <= span) {
+    level++;
+  }
+  const unsigned fpb = pf->frames_per_bucket[level];
+
+  // fetch every bucket overlapping the range in one read
+  unsigned first = start_frame / fpb;
+  unsigned last  = (end_frame - 1) / fpb;
+  unsigned count = last - first + 1;
+  int16_t *vals = malloc(count * sizeof(PeakBucket));
+  if (!vals) { fatal_error("Out of memory reading peak file."); }
+  if (fseek(pf->in, pf->offset[level] + (long) first * sizeof(PeakBucket), SEEK_SET) != 0) {
+    fatal_error("Could not seek in peak file.");
+  }
+  read_s16_buf(pf->in, vals, count * 3u * NUM_CHANNELS);
+
+  for (unsigned p = 0; p < num_pixels; p++) {
+    unsigned f0 = start_frame + (unsigned) (span * p / num_pixels);
+    unsigned f1 = start_frame + (unsigned) (span * (p + 1) / num_pixels);
+    unsigned b0 = f0 / fpb;
+    unsigned b1 = (f1 > f0 ? f1 - 1 : f0) / fpb;
+    double sum_sq[NUM_CHANNELS] = { 0.0 };
+    double frames = 0.0;
+
+    for (unsigned c = 0; c < NUM_CHANNELS; c++) {
+      out[p].min[c] = INT16_MAX;
+      out[p].max[c] = INT16_MIN;
+    }
+    for (unsigned b = b0; b <= b1; b++) {
+      const int16_t *v = vals + (b - first) * 3u * NUM_CHANNELS;
+      unsigned n = pf->num_frames - b * fpb;
+      if (n > fpb) { n = fpb; }
+      for (unsigned c = 0; c < NUM_CHANNELS; c++) {
+        if (v[3 * c] < out[p].min[c])     { out[p].min[c] = v[3 * c]; }
+        if (v[3 * c + 1] > out[p].max[c]) { out[p].max[c] = v[3 * c + 1]; }
+        sum_sq[c] += (double) v[3 * c + 2] * v[3 * c + 2] * n;
+      }
+      frames += n;
+    }
+    for (unsigned c = 0; c < NUM_CHANNELS; c++) {
+      out[p].rms[c] = (int16_t) sqrt(sum_sq[c] / frames);
+    }
+  }
+
+  free(vals);
+}
@@ -0,0 +1,73 @@
+#ifndef PEAK_H
+#define PEAK_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "wave.h"
+
+// A peak file is a companion to a WAVE file holding min/max/RMS per
+// channel for fixed-size buckets of frames at several zoom levels, so a
+// waveform display never has to touch the samples themselves.
+//
+// Layout (same byte order as the WAVE writer):
+//   "PEAK", u32 num_frames, u32 sample rate, u16 channels, u16 num_levels,
+//   num_levels x (u32 frames_per_bucket, u32 num_buckets),
+//   then each level's buckets in order, each bucket being
+//   channels x (s16 min, s16 max, s16 rms).
+//
+// Each level's bucket size must be a multiple of the previous one, since
+// coarser levels are built by merging finished finer buckets.
+#define PEAK_NUM_LEVELS 4
+extern const unsigned PEAK_FRAMES_PER_BUCKET[PEAK_NUM_LEVELS];
+
+typedef struct {
+  int16_t min[NUM_CHANNELS];
+  int16_t max[NUM_CHANNELS];
+  int16_t rms[NUM_CHANNELS];
+} PeakBucket;
+
+// Running statistics for the bucket currently being filled at one level.
+typedef struct {
+  unsigned frames;
+  int16_t min[NUM_CHANNELS];
+  int16_t max[NUM_CHANNELS];
+  double sum_sq[NUM_CHANNELS];
+} PeakAccum;
+
+typedef struct PeakBuilder {
+  unsigned num_frames;
+  PeakAccum acc[PEAK_NUM_LEVELS];
+  PeakBucket *buckets[PEAK_NUM_LEVELS];
+  unsigned num_buckets[PEAK_NUM_LEVELS];
+  unsigned capacity[PEAK_NUM_LEVELS];
+} PeakBuilder;
+
+// Build a peak file incrementally: feed each block of interleaved stereo
+// samples as it is written, then finish to write the peak file and free
+// the builder's memory.
+void peak_builder_init(PeakBuilder *pb);
+void peak_builder_add(PeakBuilder *pb, const int16_t stereo_buf[], unsigned num_frames);
+void peak_builder_finish(PeakBuilder *pb, const char *filename);
+
+typedef struct {
+  FILE *in;
+  unsigned num_frames;
+  unsigned sample_rate;
+  unsigned frames_per_bucket[PEAK_NUM_LEVELS];
+  unsigned num_buckets[PEAK_NUM_LEVELS];
+  long offset[PEAK_NUM_LEVELS];
+} PeakFile;
+
+void peak_open(PeakFile *pf, const char *filename);
+void peak_close(PeakFile *pf);
+
+// Summarize frames [start_frame, end_frame) into num_pixels buckets.
+// Reads from the coarsest level that still resolves one pixel, so the
+// cost is proportional to num_pixels rather than to the range length,
+// up to the coarsest level's bucket size per pixel (1048576 frames, about
+// 24 seconds at 44.1 kHz). Wider pixels read up to range / 1048576
+// buckets, which is at most 4096 for a 32-bit frame count.
+void peak_read_range(PeakFile *pf, unsigned start_frame, unsigned end_frame,
+                     unsigned num_pixels, PeakBucket out[]);
+
+#endif // PEAK_H
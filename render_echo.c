@@ -1,9 +1,15 @@
 #include "wave.h"
 #include "io.h"
+#include "output.h"
+#include "convert.h"
 #include <stdio.h>
 
 int main(int argc, char* argv[]) {
 
+	// Output stage options (peak file, limiter, normalization)
+	OutputOptions output_opts;
+	parse_output_options(&argc, argv, &output_opts);
+
 	// Error check input
 	if (argc != 5) {
 		fatal_error("invalid user input");
@@ -30,49 +36,48 @@ int main(int argc, char* argv[]) {
 	// Allocate num_samples
 	unsigned* num_samples_stereo = (unsigned*)malloc(sizeof(unsigned)); 
 
-	// Open file and call read_wave_header to get num_samples
+	// Open file and call read_wave_format to get the format and num_samples
 	FILE* fp_r = fopen(wavfilein, "rb");
 	if (!fp_r) {
 		fatal_error("Unable to open file");
 	}
 
-	read_wave_header(fp_r, num_samples_stereo);
+	WaveFormat fmt_in;
+	read_wave_format(fp_r, &fmt_in, num_samples_stereo);
+	if (fmt_in.sample_rate != SAMPLES_PER_SECOND) {
+		fatal_error("Bad wave header (Unexpected sample rate)");
+	}
 	*num_samples_stereo *= 2; 
 
-	// Initialize values in stereo_buf using fread
+	// Initialize values in stereo_buf, converting from the input format as we read
 	int16_t* stereo_buf = (int16_t*)calloc((*num_samples_stereo), sizeof(int16_t)); 
-
-	int num_vals = fread(stereo_buf, sizeof(stereo_buf[0]), *num_samples_stereo, fp_r);
-	if ((unsigned int)num_vals != *num_samples_stereo) {
-    	fatal_error("Number of values and stereo samples are unequal in .wav file");
+	unsigned char* scratch = (unsigned char*)malloc(CONVERT_SCRATCH_BYTES);
+	if (!scratch) {
+		fatal_error("Out of memory converting samples");
 	}
 
+	read_converted(fp_r, &fmt_in, stereo_buf, *num_samples_stereo / 2, scratch);
+	free(scratch);
+
   	// Defining and dynamically allocating output array with echo
-	int16_t* echo_result = (int16_t*)calloc((*num_samples_stereo + delay), sizeof(int16_t)); 
+	// (wide, so the echo can't overflow; the output stage limits it)
+	int32_t* echo_result = (int32_t*)calloc((*num_samples_stereo + delay), sizeof(int32_t)); 
 
 	// First put in the original stereo_buffer
 	for (unsigned int i = 0; i < *num_samples_stereo; i++) {
 		echo_result[i] = stereo_buf[i]; 
 	}
 
-	// Next apply the gain to stereo_buf
-	apply_gain(stereo_buf, *num_samples_stereo, amp); 
-
-	// Add the echo into the result
+	// Add the echo into the result, applying the gain on the wide values
+	// so amp > 1 is left to the output stage
 	for (unsigned int i = delay; i < *num_samples_stereo + delay; i++) {
-		echo_result[i] = echo_result[i] + stereo_buf[i-delay]; 
+		echo_result[i] = echo_result[i] + (int32_t)(stereo_buf[i-delay] * amp); 
 	}
 
 	// Write into new wav file
-	FILE* fp_w = fopen(wavfileout, "wb"); 
-	if (!fp_w) {
-		fatal_error("issue opening wavfileout.");
-	}
-	write_wave_header(fp_w, (*num_samples_stereo + delay) / 2); 
-	fwrite(echo_result, sizeof(echo_result[0]), *num_samples_stereo + delay, fp_w); 
+	write_output(wavfileout, echo_result, (*num_samples_stereo + delay) / 2, &output_opts);
 
 	// Free all dynamically allocated variables, close filepointers, and return 0
-	fclose(fp_w); 
 	fclose(fp_r); 
 	free(num_samples_stereo); 
 	free(stereo_buf); 
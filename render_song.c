@@ -1,31 +1,147 @@
 #include "wave.h"
 #include "io.h"
+#include "output.h"
+#include "song.h"
+#include "server.h"
 #include <stdio.h>
 
+// Build the file name for an instrument's stem from the mix file name,
+// e.g. "song.wav" becomes "song_inst03.wav".
+static void stem_filename(char name[], size_t size, const char *mix_name, int instrument) {
+  size_t len = strlen(mix_name);
+  if (len >= 4 && strcmp(mix_name + len - 4, ".wav") == 0) {
+    len -= 4;
+  }
+  if ((size_t) snprintf(name, size, "%.*s_inst%02d.wav", (int) len, mix_name, instrument) >= size) {
+    fatal_error("Stem file name is too long");
+  }
+}
+
+// A note from the song file, with the settings its instrument had when
+// the N directive was read.
 typedef struct {
-  uint16_t waveform;
-  float   angle;
-  int16_t adsr;
+  Instrument inst;
+  int instrument;
+  int note;
   float gain;
+  unsigned start;
+  unsigned num_samples;
+} SongNote;
 
-} Instrument;
+static int compare_start(const void *a, const void *b) {
+  const SongNote *x = a, *y = b;
+  return (x->start > y->start) - (x->start < y->start);
+}
+
+// Walks a start-sorted note list a block at a time, keeping the notes that
+// are still sounding.
+typedef struct {
+  const SongNote *notes;
+  unsigned num_notes;
+  unsigned next;        // first note that hasn't started yet
+  unsigned *active;     // notes sounding in the current block
+  unsigned num_active;
+} NoteCursor;
+
+// Render frames [start, start + n) of the song into mix_bus, and into
+// stem_bus[i] for each instrument i that has one (NULL for no stems). When
+// there are stems, the mix is their sum.
+static void render_block(NoteCursor *c, unsigned start, unsigned n,
+                         int32_t mix_bus[], int32_t* stem_bus[]) {
+  unsigned end = start + n;
+  memset(mix_bus, 0, n * NUM_CHANNELS * sizeof(int32_t));
+  for (int i = 0; stem_bus && i < NUM_INSTRUMENTS; i++) {
+    if (stem_bus[i]) {
+      memset(stem_bus[i], 0, n * NUM_CHANNELS * sizeof(int32_t));
+    }
+  }
+
+  while (c->next < c->num_notes && c->notes[c->next].start < end) {
+    c->active[c->num_active++] = c->next++;
+  }
+
+  unsigned kept = 0;
+  for (unsigned k = 0; k < c->num_active; k++) {
+    const SongNote *note = &c->notes[c->active[k]];
+    unsigned note_end = note->start + note->num_samples;
+    unsigned from = note->start > start ? note->start : start;
+    unsigned to   = note_end < end ? note_end : end;
+    if (from < to) {
+      int32_t *bus = stem_bus ? stem_bus[note->instrument] : mix_bus;
+      render_note_at(&note->inst, note->note, note->gain, bus + NUM_CHANNELS * (from - start),
+                     from - note->start, to - from, note->num_samples);
+    }
+    if (note_end > end) {
+      c->active[kept++] = c->active[k];
+    }
+  }
+  c->num_active = kept;
+
+  for (int i = 0; stem_bus && i < NUM_INSTRUMENTS; i++) {
+    if (stem_bus[i]) {
+      for (unsigned j = 0; j < n * NUM_CHANNELS; j++) {
+        mix_bus[j] += stem_bus[i][j];
+      }
+    }
+  }
+}
+
+static void rewind_cursor(NoteCursor *c) {
+  c->next = 0;
+  c->num_active = 0;
+}
 
 int main(int argc, char* argv[]) {
 
+  // Output stage options (peak file, limiter, normalization)
+  OutputOptions output_opts;
+  parse_output_options(&argc, argv, &output_opts);
+
+  // Stem mode: also write one WAV per instrument alongside the mix. The
+  // song is rendered a block at a time, so each stem costs one
+  // OUTPUT_BLOCK_FRAMES bus rather than a full-length one.
+  // Live mode (--serve SOCKET): read directives from a socket instead of
+  // a song file.
+  int stems = 0;
+  const char* serve_path = NULL;
+  int j = 1;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--stems") == 0) {
+      stems = 1;
+    } else if (strcmp(argv[i], "--serve") == 0) {
+      if (i + 1 >= argc) {
+        fatal_error("--serve requires a socket path");
+      }
+      serve_path = argv[++i];
+    } else {
+      argv[j++] = argv[i];
+    }
+  }
+  argc = j;
+  argv[j] = NULL;
+
+  if (serve_path) {
+    if (argc != 1 || stems) {
+      fatal_error("--serve takes no song file, output file or --stems");
+    }
+    if (output_opts.peaks_path || output_opts.normalize != NORMALIZE_NONE
+        || output_opts.format.format != INTERNAL_FORMAT.format
+        || output_opts.format.bits_per_sample != INTERNAL_FORMAT.bits_per_sample) {
+      fatal_error("--peaks, --format and --normalize-* don't apply to --serve");
+    }
+    serve_song(serve_path, &output_opts);
+    return 0;
+  }
+
   // Error check the command lines
   if (argc != 3) {
     fatal_error("Not enough input arguments");
   }
 
-  Instrument instruments[16];
+  Instrument instruments[NUM_INSTRUMENTS];
 
   // Initialize all instruments as a default instrument
-  for (int i = 0; i < 16; i++) {
-    instruments[i].waveform = 0; 
-    instruments[i].angle = 0.0f; 
-    instruments[i].adsr = 0; 
-    instruments[i].gain = 0.2; 
-  }
+  init_instruments(instruments);
 
   // Reading file
   int num_samples;
@@ -37,8 +153,14 @@ int main(int argc, char* argv[]) {
   }
 
   // Reading the number of stereo sample pairs in .wav file
-  fscanf(fpr, " %d", &num_samples);
-  int16_t* stereo_buf = calloc(num_samples * 2, sizeof(int16_t)); 
+  if (fscanf(fpr, " %d", &num_samples) != 1 || num_samples < 0) {
+    fatal_error("Invalid number of samples in song file");
+  }
+
+  // Notes are collected first and rendered block by block afterwards
+  SongNote* notes = NULL;
+  unsigned num_notes = 0, capacity = 0;
+  int played[NUM_INSTRUMENTS] = { 0 };
 
   // file reading variables
   // f = related to file | n = related to N directive 
@@ -67,62 +189,30 @@ int main(int argc, char* argv[]) {
           fatal_error("Missing data for N directive");
         }
 
-        if (n_start < 0 || n_end < 0 || n_note < 0 || n_gain < 0) {
+        if (n_start < 0 || n_end < n_start || n_note < 0 || n_gain < 0) {
           fatal_error("invalid value in directive information.");
         }
 
-        // Dynamically allocating each stereo mono buffer array and initializing to 0
-        int16_t* left_monobuf  = calloc(n_end - n_start + 1, sizeof(int16_t));
-        int16_t* right_monobuf = calloc(n_end - n_start + 1, sizeof(int16_t));
-
-        // Converting MIDI to frequency
-        float freq = 440 * pow(2, (n_note - 69) / 12.0f);
-
-        // Generating waveform
-        switch (instruments[f_instrument].waveform) {
-          case 0:
-            generate_sine_wave(left_monobuf, n_end - n_start + 1, freq);
-            generate_sine_wave(right_monobuf, n_end - n_start + 1, freq);
-            break;
-          case 1:
-            generate_square_wave(left_monobuf, n_end - n_start + 1, freq);
-            generate_square_wave(right_monobuf, n_end - n_start + 1, freq);
-            break;
-          case 2:
-            generate_saw_wave(left_monobuf, n_end - n_start + 1, freq);
-            generate_saw_wave(right_monobuf, n_end - n_start + 1, freq);
-            break;
-          default:
-            fatal_error("Invalid waveform value in song file");
+        if (f_instrument < 0 || f_instrument >= NUM_INSTRUMENTS) {
+          fatal_error("Invalid instrument in N directive");
         }
 
-        // Apply gain
-        apply_gain(left_monobuf, n_end - n_start + 1, n_gain);
-        apply_gain(right_monobuf, n_end - n_start + 1, n_gain);
-        apply_gain(left_monobuf, n_end - n_start + 1, instruments[f_instrument].gain);
-        apply_gain(right_monobuf, n_end - n_start + 1, instruments[f_instrument].gain);
-
-        // Apply asdr, if applicable
-        if (instruments[f_instrument].adsr == 1) {
-          apply_adsr_envelope(left_monobuf, n_end - n_start + 1);
-          apply_adsr_envelope(right_monobuf, n_end - n_start + 1);
+        // Keep the note with the instrument's current settings
+        if (num_notes == capacity) {
+          capacity = capacity ? 2 * capacity : 64u;
+          notes = realloc(notes, capacity * sizeof(SongNote));
+          if (!notes) {
+            fatal_error("Out of memory reading song");
+          }
         }
-
-        // Find what the left+right channel gains would be 
-        float channel_gain[] = {0.0f, 0.0f};
-        compute_pan(instruments[f_instrument].angle, channel_gain);
-
-        // Apply gain from channel_gain for each left and right
-        apply_gain(left_monobuf, n_end - n_start + 1, channel_gain[0]);
-        apply_gain(right_monobuf, n_end - n_start + 1, channel_gain[1]); 
-
-        // Mix these together into stereo_buf
-        mix_in(stereo_buf + (2 * n_start), 0, left_monobuf, n_end - n_start + 1);
-        mix_in(stereo_buf + (2 * n_start), 1, right_monobuf, n_end - n_start + 1);
-
-        // Freeing allocated memory for left_monobuf and right_monobuf
-        free(left_monobuf);
-        free(right_monobuf);
+        notes[num_notes].inst = instruments[f_instrument];
+        notes[num_notes].instrument = f_instrument;
+        notes[num_notes].note = n_note;
+        notes[num_notes].gain = n_gain;
+        notes[num_notes].start = n_start;
+        notes[num_notes].num_samples = n_end - n_start + 1;
+        num_notes++;
+        played[f_instrument] = 1;
 
         break;
 
@@ -159,20 +249,82 @@ int main(int argc, char* argv[]) {
     }
   } while(num_c == 1);
 
-  // Open filewriter for output .wav file
-  FILE* fpr_w = fopen(argv[2], "wb");
-  write_wave_header(fpr_w, num_samples); 
+  fclose(fpr);
+  qsort(notes, num_notes, sizeof(SongNote), compare_start);
 
-  if (!fpr_w) {
-    fatal_error("error opening writing file");
+  NoteCursor cursor = { notes, num_notes, 0, malloc((num_notes + 1) * sizeof(unsigned)), 0 };
+  int32_t mix_bus[OUTPUT_BLOCK_FRAMES * NUM_CHANNELS];
+  int32_t* stem_bus[NUM_INSTRUMENTS] = { NULL };
+  if (!cursor.active) {
+    fatal_error("Out of memory reading song");
+  }
+  for (int i = 0; stems && i < NUM_INSTRUMENTS; i++) {
+    if (played[i]) {
+      stem_bus[i] = malloc(OUTPUT_BLOCK_FRAMES * NUM_CHANNELS * sizeof(int32_t));
+      if (!stem_bus[i]) {
+        fatal_error("Out of memory allocating stem");
+      }
+    }
+  }
+
+  // Normalizing needs the level of the whole song, so it takes an extra
+  // rendering pass to measure it
+  float gain = 1.0f;
+  if (output_opts.normalize != NORMALIZE_NONE) {
+    OutputMeter meter;
+    output_meter_init(&meter);
+    for (int start = 0; start < num_samples; start += OUTPUT_BLOCK_FRAMES) {
+      int n = num_samples - start < (int) OUTPUT_BLOCK_FRAMES ? num_samples - start : (int) OUTPUT_BLOCK_FRAMES;
+      render_block(&cursor, start, n, mix_bus, NULL);
+      output_meter_add(&meter, mix_bus, n);
+    }
+    gain = output_meter_gain(&meter, &output_opts);
+    rewind_cursor(&cursor);
+  }
+
+  // Open the mix and a file for each instrument that played. Stems share
+  // the mix's normalization gain and follow its limiter's gain curve, so
+  // they still add up to it
+  OutputStage mix_w;
+  output_open(&mix_w, argv[2], num_samples, gain, &output_opts, 1);
+  OutputStage* stem_w[NUM_INSTRUMENTS] = { NULL };
+  for (int i = 0; i < NUM_INSTRUMENTS; i++) {
+    if (stem_bus[i]) {
+      char name[FILENAME_MAX];
+      stem_filename(name, sizeof(name), argv[2], i);
+      stem_w[i] = malloc(sizeof(OutputStage));
+      if (!stem_w[i]) {
+        fatal_error("Out of memory allocating stem");
+      }
+      output_open(stem_w[i], name, num_samples, gain, &output_opts, 0);
+      output_follow(stem_w[i], &mix_w);
+    }
   }
 
-  fwrite(stereo_buf, sizeof(stereo_buf[0]), 2*num_samples, fpr_w);
+  // Render the mix and the stems and stream them out together, one block
+  // at a time
+  for (int start = 0; start < num_samples; start += OUTPUT_BLOCK_FRAMES) {
+    int n = num_samples - start < (int) OUTPUT_BLOCK_FRAMES ? num_samples - start : (int) OUTPUT_BLOCK_FRAMES;
+    render_block(&cursor, start, n, mix_bus, stems ? stem_bus : NULL);
+    output_write(&mix_w, mix_bus, n);
+    for (int i = 0; i < NUM_INSTRUMENTS; i++) {
+      if (stem_w[i]) {
+        output_write(stem_w[i], stem_bus[i], n);
+      }
+    }
+  }
 
   // Close all the files and free all dynamically allocated memory
-  fclose(fpr);
-  fclose(fpr_w);
-  free(stereo_buf);
+  output_close(&mix_w);
+  for (int i = 0; i < NUM_INSTRUMENTS; i++) {
+    if (stem_w[i]) {
+      output_close(stem_w[i]);
+      free(stem_w[i]);
+    }
+    free(stem_bus[i]);
+  }
+  free(cursor.active);
+  free(notes);
 
 	return 0; 
 }
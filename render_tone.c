@@ -1,9 +1,14 @@
 #include "wave.h"
 #include "io.h"
+#include "output.h"
 #include <stdio.h>
 
 int main(int argc, char* argv[]) {
 
+	// output stage options (peak file, limiter, normalization)
+	OutputOptions output_opts;
+	parse_output_options(&argc, argv, &output_opts);
+
 	// error check the command lines
 	if (argc != 6) {
 		fatal_error("not enough input arguments");
@@ -52,29 +57,18 @@ int main(int argc, char* argv[]) {
 			fatal_error("invalid waveform option");
 	}
 
-	// call apply_gain
-	apply_gain(waveform_vals, numsamples, amp);
-
-	// initialize the stereo buffer and mix into left and right channels
-	int16_t* stereo_buf = calloc(numsamples * 2, sizeof(int16_t));
+	// initialize the stereo buffer and mix into left and right channels,
+	// applying the gain there so amp > 1 is left to the output stage
+	int32_t* stereo_buf = calloc(numsamples * 2, sizeof(int32_t));
 	
-	mix_in(stereo_buf, 0, waveform_vals, numsamples);
-	mix_in(stereo_buf, 1, waveform_vals, numsamples);
+	mix_in_bus(stereo_buf, 0, waveform_vals, numsamples, amp);
+	mix_in_bus(stereo_buf, 1, waveform_vals, numsamples, amp);
 
 	// now that all the values are loaded in, we can write it to wavfileout
-	// first write to header, then write raw data in
-	FILE* fp = fopen(wavfileout, "wb");
-	write_wave_header(fp, numsamples);
-
-	// error check and fwrite into the file
-	if (!fp) {
-		fatal_error("error opening file.");
-	}
-
-	fwrite(stereo_buf, sizeof(waveform_vals[0]), 2*numsamples, fp); 
+	// through the output stage
+	write_output(wavfileout, stereo_buf, numsamples, &output_opts);
 
-	// close file pointer and free dynamically allocated memory
-	fclose(fp); 
+	// free dynamically allocated memory
 	free(waveform_vals);
 	free(stereo_buf);
 
@@ -0,0 +1,332 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "io.h"
+#include "wave.h"
+#include "song.h"
+#include "output.h"
+#include "server.h"
+
+#define LINE_MAX_CHARS 256
+
+// A note being mixed into the stream. Its samples are synthesized one
+// block at a time, with the instrument settings it started with.
+typedef struct {
+  Instrument inst;
+  int note;
+  float gain;
+  unsigned num_samples;
+  uint64_t start_frame;     // stream frame of the note's first sample
+} ActiveNote;
+
+typedef struct {
+  int fd;
+  Instrument instruments[NUM_INSTRUMENTS];
+  int limit;                // run the limiter (otherwise hard-clip)
+  Limiter limiter;
+  ActiveNote notes[SERVER_MAX_NOTES];
+  unsigned num_notes;
+  uint64_t frame;           // first frame of the next block to render
+  char line[LINE_MAX_CHARS];
+  unsigned line_len;
+  int discard_line;         // current line overflowed, skip to newline
+  struct timespec start;    // when the session began
+
+  // notes added since the last block was sent; their arrival times (ms
+  // since start) are summarized, since they all first reach the output at
+  // the same frame of the next block
+  unsigned num_pending;
+  double pending_sum, pending_first, pending_last;
+
+  unsigned num_events;
+  double latency_sum, latency_min, latency_max; // milliseconds
+} Session;
+
+static double elapsed_ms(const struct timespec *from, const struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) * 1e3 + (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+// Returns 0 if the note can't be added because too many are playing.
+static int add_note(Session *s, const Instrument *inst, unsigned start, unsigned end,
+                    int note, float gain) {
+  if (s->num_notes == SERVER_MAX_NOTES) {
+    return 0;
+  }
+
+  ActiveNote *n = &s->notes[s->num_notes];
+  n->inst = *inst;
+  n->note = note;
+  n->gain = gain;
+  n->num_samples = end - start + 1;
+  n->start_frame = s->frame + start;
+  s->num_notes++;
+  return 1;
+}
+
+// Note that an N directive that arrived at arrival_ms has been applied; it
+// is timed when the next block goes out.
+static void pending_event(Session *s, double arrival_ms) {
+  if (s->num_pending == 0) {
+    s->pending_first = arrival_ms;
+  }
+  s->pending_last = arrival_ms;
+  s->pending_sum += arrival_ms;
+  s->num_pending++;
+}
+
+// Apply one directive line. Bad lines are reported and skipped rather than
+// ending the session.
+static void handle_line(Session *s, const char *line, double arrival_ms) {
+  char directive;
+  int inst, i1, i2, note;
+  unsigned waveform;
+  float f;
+
+  if (sscanf(line, " %c", &directive) != 1) {
+    return; // blank line
+  }
+
+  switch (directive) {
+    case 'N':
+      if (sscanf(line, " N %d %d %d %d %f", &inst, &i1, &i2, &note, &f) != 5
+          || inst < 0 || inst >= NUM_INSTRUMENTS || i1 < 0 || i2 < i1 || note < 0 || f < 0
+          || (unsigned) i2 >= SERVER_MAX_NOTE_FRAMES) {
+        break;
+      }
+      if (!add_note(s, &s->instruments[inst], i1, i2, note, f)) {
+        fprintf(stderr, "Too many notes playing, ignoring: %s\n", line);
+        return;
+      }
+      pending_event(s, arrival_ms);
+      return;
+
+    case 'W':
+      if (sscanf(line, " W %d %u", &inst, &waveform) != 2
+          || inst < 0 || inst >= NUM_INSTRUMENTS || waveform >= NUM_WAVEFORMS) {
+        break;
+      }
+      s->instruments[inst].waveform = waveform;
+      return;
+
+    case 'P':
+      if (sscanf(line, " P %d %f", &inst, &f) != 2 || inst < 0 || inst >= NUM_INSTRUMENTS) {
+        break;
+      }
+      s->instruments[inst].angle = f;
+      return;
+
+    case 'E':
+      if (sscanf(line, " E %d %d", &inst, &i1) != 2 || inst < 0 || inst >= NUM_INSTRUMENTS) {
+        break;
+      }
+      s->instruments[inst].adsr = i1;
+      return;
+
+    case 'G':
+      if (sscanf(line, " G %d %f", &inst, &f) != 2 || inst < 0 || inst >= NUM_INSTRUMENTS) {
+        break;
+      }
+      s->instruments[inst].gain = f;
+      return;
+
+    default:
+      break;
+  }
+  fprintf(stderr, "Ignoring bad directive: %s\n", line);
+}
+
+// Read whatever the client has sent and apply each complete line.
+// Returns 0 once the client has closed the connection.
+static int read_events(Session *s) {
+  char buf[1024];
+  ssize_t n = recv(s->fd, buf, sizeof(buf), 0);
+  if (n <= 0) {
+    return n < 0 && (errno == EINTR || errno == EAGAIN);
+  }
+
+  struct timespec arrival;
+  clock_gettime(CLOCK_MONOTONIC, &arrival);
+  double arrival_ms = elapsed_ms(&s->start, &arrival);
+
+  for (ssize_t i = 0; i < n; i++) {
+    if (buf[i] == '\n') {
+      s->line[s->line_len] = '\0';
+      if (!s->discard_line) {
+        handle_line(s, s->line, arrival_ms);
+      }
+      s->line_len = 0;
+      s->discard_line = 0;
+    } else if (s->line_len + 1 < LINE_MAX_CHARS) {
+      s->line[s->line_len++] = buf[i];
+    } else if (!s->discard_line) {
+      fprintf(stderr, "Ignoring overlong directive line\n");
+      s->discard_line = 1;
+    }
+  }
+  return 1;
+}
+
+// Mix every active note into the next block, send it, and retire notes
+// that have finished. Returns 0 if the client has gone away.
+static int send_block(Session *s) {
+  int32_t bus[SERVER_BLOCK_FRAMES * NUM_CHANNELS];
+  int16_t block[SERVER_BLOCK_FRAMES * NUM_CHANNELS];
+  uint64_t block_end = s->frame + SERVER_BLOCK_FRAMES;
+  memset(bus, 0, sizeof(bus));
+
+  for (unsigned i = 0; i < s->num_notes; i++) {
+    ActiveNote *n = &s->notes[i];
+    uint64_t note_end = n->start_frame + n->num_samples;
+    if (n->start_frame >= block_end || note_end <= s->frame) {
+      continue;
+    }
+    uint64_t from = n->start_frame > s->frame ? n->start_frame : s->frame;
+    uint64_t to   = note_end < block_end ? note_end : block_end;
+    render_note_at(&n->inst, n->note, n->gain, bus + NUM_CHANNELS * (from - s->frame),
+                   from - n->start_frame, to - from, n->num_samples);
+  }
+
+  // same limiter as the output stage, so overlapping notes don't clip
+  for (unsigned i = 0; i < SERVER_BLOCK_FRAMES; i++) {
+    float in[NUM_CHANNELS], out[NUM_CHANNELS], gain = 1.0f;
+    for (unsigned c = 0; c < NUM_CHANNELS; c++) {
+      in[c] = out[c] = bus[NUM_CHANNELS * i + c];
+    }
+    if (s->limit) {
+      limiter_push(&s->limiter, in, out, &gain);
+    }
+    for (unsigned c = 0; c < NUM_CHANNELS; c++) {
+      block[NUM_CHANNELS * i + c] = clip_sample(out[c] * gain);
+    }
+  }
+
+  const char *data = (const char *) block;
+  size_t remaining = sizeof(block);
+  while (remaining > 0) {
+    ssize_t sent = send(s->fd, data, remaining, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) { continue; }
+      return 0;
+    }
+    data += sent;
+    remaining -= sent;
+  }
+
+  // Pending notes start at this block's first frame, which comes out of
+  // the limiter lookahead - 1 frames later, still within this block. It
+  // plays at its place in the stream, or now if the block is late.
+  if (s->num_pending > 0) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t first_out = s->frame + (s->limit ? SERVER_LIMITER_LOOKAHEAD - 1 : 0);
+    double play_ms = first_out * 1e3 / SAMPLES_PER_SECOND;
+    double now_ms = elapsed_ms(&s->start, &now);
+    if (play_ms > now_ms) { now_ms = play_ms; }
+    double shortest = now_ms - s->pending_last, longest = now_ms - s->pending_first;
+    if (s->num_events == 0 || shortest < s->latency_min) { s->latency_min = shortest; }
+    if (s->num_events == 0 || longest > s->latency_max) { s->latency_max = longest; }
+    s->latency_sum += s->num_pending * now_ms - s->pending_sum;
+    s->num_events += s->num_pending;
+    s->num_pending = 0;
+    s->pending_sum = 0.0;
+  }
+
+  unsigned kept = 0;
+  for (unsigned i = 0; i < s->num_notes; i++) {
+    ActiveNote *n = &s->notes[i];
+    if (n->start_frame + n->num_samples > block_end) {
+      s->notes[kept++] = *n;
+    }
+  }
+  s->num_notes = kept;
+  s->frame = block_end;
+  return 1;
+}
+
+static void run_session(int fd, const OutputOptions *opts) {
+  Session s;
+  memset(&s, 0, sizeof(s));
+  s.fd = fd;
+  init_instruments(s.instruments);
+  s.limit = opts->limit;
+
+  // prime the limiter with silence so every frame pushed yields one out
+  float silence[NUM_CHANNELS] = { 0.0f }, unused[NUM_CHANNELS], unused_gain;
+  limiter_init(&s.limiter, SERVER_LIMITER_LOOKAHEAD, opts->ceiling);
+  for (unsigned i = 0; i + 1 < SERVER_LIMITER_LOOKAHEAD; i++) {
+    limiter_push(&s.limiter, silence, unused, &unused_gain);
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &s.start);
+
+  for (;;) {
+    // Stay at most SERVER_LEAD_BLOCKS ahead of real time, waiting for
+    // events in the meantime.
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double due_ms = ((double) s.frame - SERVER_LEAD_BLOCKS * SERVER_BLOCK_FRAMES) * 1e3 / SAMPLES_PER_SECOND;
+    double wait_ms = due_ms - elapsed_ms(&s.start, &now);
+
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    int ready = poll(&pfd, 1, wait_ms > 0.0 ? (int) wait_ms : 0);
+    if (ready > 0 && !read_events(&s)) {
+      break;
+    }
+    if (ready > 0 && wait_ms > 0.0) {
+      continue; // handled input early; recheck the clock
+    }
+    if (!send_block(&s)) {
+      break;
+    }
+  }
+
+  if (s.num_events > 0) {
+    fprintf(stderr, "Session ended: %u notes, note-to-play latency min %.3f ms, avg %.3f ms, max %.3f ms"
+            " (includes %.3f ms limiter delay and up to %.3f ms send-ahead)\n",
+            s.num_events, s.latency_min, s.latency_sum / s.num_events, s.latency_max,
+            (s.limit ? SERVER_LIMITER_LOOKAHEAD - 1 : 0) * 1e3 / SAMPLES_PER_SECOND,
+            SERVER_LEAD_BLOCKS * SERVER_BLOCK_FRAMES * 1e3 / SAMPLES_PER_SECOND);
+  } else {
+    fprintf(stderr, "Session ended: no notes\n");
+  }
+}
+
+void serve_song(const char *socket_path, const OutputOptions *opts) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fatal_error("Socket path is too long");
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0) {
+    fatal_error("Could not create socket");
+  }
+  unlink(socket_path);
+  if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+    fatal_error("Could not bind socket");
+  }
+  if (listen(listen_fd, 1) != 0) {
+    fatal_error("Could not listen on socket");
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  fprintf(stderr, "Listening on %s\n", socket_path);
+  for (;;) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR) { continue; }
+      fatal_error("Could not accept connection");
+    }
+    run_session(fd, opts);
+    close(fd);
+  }
+}
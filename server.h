@@ -0,0 +1,47 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "wave.h"
+#include "output.h"
+
+// Live rendering over a Unix domain socket.
+//
+// A client connects and sends song directives (N, W, P, E, G) one per
+// line, using the same syntax as a song file. The server renders in
+// blocks of SERVER_BLOCK_FRAMES, paced to real time, and streams raw
+// interleaved 16-bit stereo PCM (no header) back on the same socket.
+//
+// In live mode the start and end of an N directive are frame offsets
+// relative to the first block rendered after the directive arrives, so
+// "N 0 0 22049 60 1.0" plays middle C for half a second right away.
+//
+// Output goes through the output stage's lookahead limiter, with a
+// lookahead of SERVER_LIMITER_LOOKAHEAD frames instead of the usual
+// LIMITER_LOOKAHEAD_FRAMES, so it delays the stream by under one block.
+// Of the output options only --no-limit and --ceiling apply.
+//
+// When a client disconnects, the latency of each note is reported on
+// stderr: the time from the arrival of its N directive to when its first
+// output frame plays. Blocks are sent SERVER_LEAD_BLOCKS ahead of play, so
+// a frame plays at the session start plus its position in the stream, or
+// when it is sent if the server has fallen behind. This includes the
+// limiter's lookahead delay and the lead; a note's requested start offset
+// is deliberate and not counted. Other directives affect no frame of their
+// own and are not timed.
+//
+// Notes are synthesized a block at a time, so the work per block depends
+// only on how many notes are sounding (at most SERVER_MAX_NOTES), never on
+// how long they are. Notes ending more than SERVER_MAX_NOTE_FRAMES after
+// they arrive are rejected, as are malformed directives; a bad client
+// never stops the server.
+#define SERVER_BLOCK_FRAMES    64u
+#define SERVER_LEAD_BLOCKS     2u
+#define SERVER_MAX_NOTES       256u
+#define SERVER_MAX_NOTE_FRAMES (60u * 60u * SAMPLES_PER_SECOND)
+#define SERVER_LIMITER_LOOKAHEAD SERVER_BLOCK_FRAMES
+
+// Serve clients one at a time on the given socket path, forever, limiting
+// as opts asks. Failing to set up the socket is a fatal error.
+void serve_song(const char *socket_path, const OutputOptions *opts);
+
+#endif // SERVER_H
@@ -0,0 +1,59 @@
+#include "io.h"
+#include "song.h"
+
+void init_instruments(Instrument instruments[]) {
+  for (int i = 0; i < NUM_INSTRUMENTS; i++) {
+    instruments[i].waveform = 0; 
+    instruments[i].angle = 0.0f; 
+    instruments[i].adsr = 0; 
+    instruments[i].gain = 0.2; 
+  }
+}
+
+// Samples generated per pass, so a note of any length needs no allocation
+#define NOTE_CHUNK_SAMPLES 1024u
+
+void render_note_at(const Instrument *inst, int note, float gain, int32_t stereo_bus[],
+                    unsigned first, unsigned count, unsigned num_samples) {
+  // Converting MIDI to frequency
+  float freq = 440 * pow(2, (note - 69) / 12.0f);
+
+  // Find what the left+right channel gains would be, with the note and
+  // instrument gains folded in; they are applied in float as the note is
+  // mixed, so nothing clips before the output stage
+  float channel_gain[] = {0.0f, 0.0f};
+  compute_pan(inst->angle, channel_gain);
+  channel_gain[0] *= gain * inst->gain;
+  channel_gain[1] *= gain * inst->gain;
+
+  int16_t wave[NOTE_CHUNK_SAMPLES];
+  for (unsigned done = 0; done < count; done += NOTE_CHUNK_SAMPLES) {
+    unsigned n = count - done < NOTE_CHUNK_SAMPLES ? count - done : NOTE_CHUNK_SAMPLES;
+
+    // Generating waveform at full amplitude
+    switch (inst->waveform) {
+      case 0:
+        generate_sine_wave_at(wave, first + done, n, freq);
+        break;
+      case 1:
+        generate_square_wave_at(wave, first + done, n, freq);
+        break;
+      case 2:
+        generate_saw_wave_at(wave, first + done, n, freq);
+        break;
+      default:
+        fatal_error("Invalid waveform value in song file");
+    }
+
+    // Apply asdr, if applicable, along with the gains
+    int32_t *dst = stereo_bus + 2 * done;
+    for (unsigned j = 0; j < n; j++) {
+      float s = wave[j];
+      if (inst->adsr == 1) {
+        s *= adsr_level(first + done + j, num_samples);
+      }
+      dst[2 * j]     += (int32_t) (s * channel_gain[0]);
+      dst[2 * j + 1] += (int32_t) (s * channel_gain[1]);
+    }
+  }
+}
@@ -0,0 +1,28 @@
+#ifndef SONG_H
+#define SONG_H
+
+#include <stdint.h>
+#include "wave.h"
+
+#define NUM_INSTRUMENTS 16
+
+typedef struct {
+  uint16_t waveform;
+  float   angle;
+  int16_t adsr;
+  float gain;
+
+} Instrument;
+
+// Set every instrument to the default instrument.
+void init_instruments(Instrument instruments[]);
+
+// Synthesize samples first .. first+count-1 of one note (MIDI note number)
+// num_samples long for an instrument, and add them to a wide stereo bus of
+// count frames, with note gain, instrument gain, ADSR envelope and pan
+// applied. Nothing is clipped; the output stage limits the bus. Notes can
+// be rendered one block at a time this way.
+void render_note_at(const Instrument *inst, int note, float gain, int32_t stereo_bus[],
+                    unsigned first, unsigned count, unsigned num_samples);
+
+#endif // SONG_H
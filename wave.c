@@ -1,20 +1,33 @@
 #include "io.h"
 #include "wave.h"
+#include "peak.h"
+
+const WaveFormat INTERNAL_FORMAT = {
+  WAVE_FORMAT_PCM, NUM_CHANNELS, SAMPLES_PER_SECOND, BITS_PER_SAMPLE, NUM_CHANNELS * (BITS_PER_SAMPLE/8u)
+};
 
 void write_wave_header(FILE *out, unsigned num_samples) {
+  write_wave_format(out, &INTERNAL_FORMAT, num_samples);
+}
+
+void write_wave_format(FILE *out, const WaveFormat *fmt, unsigned num_samples) {
   //
   // See: http://soundfile.sapp.org/doc/WaveFormat/
   //
 
   uint32_t ChunkSize, Subchunk1Size, Subchunk2Size;
-  uint16_t NumChannels = NUM_CHANNELS;
-  uint32_t ByteRate = SAMPLES_PER_SECOND * NumChannels * (BITS_PER_SAMPLE/8u);
-  uint16_t BlockAlign = NumChannels * (BITS_PER_SAMPLE/8u);
+  uint16_t NumChannels = fmt->num_channels;
+  uint32_t ByteRate = fmt->sample_rate * fmt->block_align;
+  uint16_t BlockAlign = fmt->block_align;
+
+  // Formats other than PCM need a cbSize field in "fmt " and a "fact"
+  // chunk holding the number of frames
+  int is_pcm = fmt->format == WAVE_FORMAT_PCM;
 
   // Subchunk2Size is the total amount of sample data
-  Subchunk2Size = num_samples * NumChannels * (BITS_PER_SAMPLE/8u);
-  Subchunk1Size = 16u;
-  ChunkSize = 4u + (8u + Subchunk1Size) + (8u + Subchunk2Size);
+  Subchunk2Size = num_samples * BlockAlign;
+  Subchunk1Size = is_pcm ? 16u : 18u;
+  ChunkSize = 4u + (8u + Subchunk1Size) + (is_pcm ? 0u : 8u + 4u) + (8u + Subchunk2Size);
 
   // Write the RIFF chunk descriptor
   write_bytes(out, "RIFF", 4u);
@@ -24,22 +37,87 @@ void write_wave_header(FILE *out, unsigned num_samples) {
   // Write the "fmt " sub-chunk
   write_bytes(out, "fmt ", 4u);       // Subchunk1ID
   write_u32(out, Subchunk1Size);
-  write_u16(out, 1u);                 // PCM format
+  write_u16(out, fmt->format);        // PCM or float format
   write_u16(out, NumChannels);
-  write_u32(out, SAMPLES_PER_SECOND); // SampleRate
+  write_u32(out, fmt->sample_rate);   // SampleRate
   write_u32(out, ByteRate);
   write_u16(out, BlockAlign);
-  write_u16(out, BITS_PER_SAMPLE);
+  write_u16(out, fmt->bits_per_sample);
+  if (!is_pcm) {
+    write_u16(out, 0u);               // cbSize: no extension
+
+    write_bytes(out, "fact", 4u);
+    write_u32(out, 4u);
+    write_u32(out, num_samples);      // dwSampleLength
+  }
 
   // Write the beginning of the "data" sub-chunk, but not the actual data
   write_bytes(out, "data", 4);        // Subchunk2ID
   write_u32(out, Subchunk2Size);
 }
 
-void read_wave_header(FILE *in, unsigned *num_samples) {
+// Skip over the rest of a chunk (chunks are padded to an even length).
+static void skip_chunk(FILE *in, uint32_t size) {
+  if (fseek(in, (long) size + (size & 1u), SEEK_CUR) != 0) {
+    fatal_error("Bad wave header (truncated chunk)");
+  }
+}
+
+static void read_fmt_chunk(FILE *in, uint32_t Subchunk1Size, WaveFormat *fmt) {
+  uint32_t ByteRate;
+  uint16_t cbSize, ValidBits;
+  uint32_t ChannelMask;
+  char SubFormat[16];
+
+  if (Subchunk1Size < 16u) {
+    fatal_error("Bad wave header (Subchunk1Size was less than 16)");
+  }
+  read_u16(in, &fmt->format);
+  read_u16(in, &fmt->num_channels);
+  read_u32(in, &fmt->sample_rate);
+  read_u32(in, &ByteRate); // ignore
+  read_u16(in, &fmt->block_align);
+  read_u16(in, &fmt->bits_per_sample);
+  uint32_t remaining = Subchunk1Size - 16u;
+
+  // the real format of an extensible file is the first two bytes of its GUID
+  if (fmt->format == WAVE_FORMAT_EXTENSIBLE) {
+    if (remaining < 24u) {
+      fatal_error("Bad wave header (short WAVE_FORMAT_EXTENSIBLE chunk)");
+    }
+    read_u16(in, &cbSize);      // ignore
+    read_u16(in, &ValidBits);   // ignore, samples are taken at container size
+    read_u32(in, &ChannelMask); // ignore
+    read_bytes(in, SubFormat, 16u);
+    fmt->format = (uint16_t) ((unsigned char) SubFormat[0] | ((unsigned char) SubFormat[1] << 8));
+    remaining -= 24u;
+  }
+  skip_chunk(in, remaining);
+
+  if (fmt->format == WAVE_FORMAT_PCM) {
+    if (fmt->bits_per_sample != 8u && fmt->bits_per_sample != 16u
+        && fmt->bits_per_sample != 24u && fmt->bits_per_sample != 32u) {
+      fatal_error("Bad wave header (Unexpected bits per sample)");
+    }
+  } else if (fmt->format == WAVE_FORMAT_IEEE_FLOAT) {
+    if (fmt->bits_per_sample != 32u) {
+      fatal_error("Bad wave header (only 32-bit float is supported)");
+    }
+  } else {
+    fatal_error("Bad wave header (AudioFormat is not PCM or float)");
+  }
+  if (fmt->num_channels != 1u && fmt->num_channels != 2u) {
+    fatal_error("Bad wave header (NumChannels is not 1 or 2)");
+  }
+  if (fmt->block_align != fmt->num_channels * (fmt->bits_per_sample/8u)) {
+    fatal_error("Bad wave header (Unexpected block align)");
+  }
+}
+
+void read_wave_format(FILE *in, WaveFormat *fmt, unsigned *num_samples) {
   char label_buf[4];
-  uint32_t ChunkSize, Subchunk1Size, SampleRate, ByteRate, Subchunk2Size;
-  uint16_t AudioFormat, NumChannels, BlockAlign, BitsPerSample;
+  uint32_t ChunkSize, SubchunkSize;
+  int have_fmt = 0;
 
   read_bytes(in, label_buf, 4u);
   if (memcmp(label_buf, "RIFF", 4u) != 0) {
@@ -53,50 +131,55 @@ void read_wave_header(FILE *in, unsigned *num_samples) {
     fatal_error("Bad wave header (no WAVE label)");
   }
 
-  read_bytes(in, label_buf, 4u);
-  if (memcmp(label_buf, "fmt ", 4u) != 0) {
-    fatal_error("Bad wave header (no 'fmt ' subchunk ID)");
-  }
+  // walk the sub-chunks until we reach the sample data
+  for (;;) {
+    if (fread(label_buf, 1u, 4u, in) != 4u) {
+      fatal_error("Bad wave header (no 'data' subchunk ID)");
+    }
+    read_u32(in, &SubchunkSize);
 
-  read_u32(in, &Subchunk1Size);
-  //printf("Subchunk1Size=%u\n", Subchunk1Size);
-  if (Subchunk1Size != 16u) {
-    fatal_error("Bad wave header (Subchunk1Size was not 16)");
+    if (memcmp(label_buf, "fmt ", 4u) == 0) {
+      read_fmt_chunk(in, SubchunkSize, fmt);
+      have_fmt = 1;
+    } else if (memcmp(label_buf, "data", 4u) == 0) {
+      if (!have_fmt) {
+        fatal_error("Bad wave header (no 'fmt ' subchunk before data)");
+      }
+      *num_samples = SubchunkSize / fmt->block_align;
+      return;
+    } else {
+      skip_chunk(in, SubchunkSize);
+    }
   }
+}
 
-  read_u16(in, &AudioFormat);
-  if (AudioFormat != 1u) {
+void read_wave_header(FILE *in, unsigned *num_samples) {
+  WaveFormat fmt;
+  read_wave_format(in, &fmt, num_samples);
+
+  if (fmt.format != WAVE_FORMAT_PCM) {
     fatal_error("Bad wave header (AudioFormat is not PCM)");
   }
-
-  read_u16(in, &NumChannels);
-  if (NumChannels != NUM_CHANNELS) {
+  if (fmt.num_channels != NUM_CHANNELS) {
     fatal_error("Bad wave header (NumChannels is not 2)");
   }
-
-  read_u32(in, &SampleRate);
-  if (SampleRate != SAMPLES_PER_SECOND) {
+  if (fmt.sample_rate != SAMPLES_PER_SECOND) {
     fatal_error("Bad wave header (Unexpected sample rate)");
   }
-
-  read_u32(in, &ByteRate); // ignore
-
-  read_u16(in, &BlockAlign); // ignore
-
-  read_u16(in, &BitsPerSample);
-  if (BitsPerSample != BITS_PER_SAMPLE) {
+  if (fmt.bits_per_sample != BITS_PER_SAMPLE) {
     fatal_error("Bad wave header (Unexpected bits per sample)");
   }
+}
 
-  read_bytes(in, label_buf, 4u);
-  if (memcmp(label_buf, "data", 4u) != 0) {
-    fatal_error("Bad wave header (no 'data' subchunk ID)");
+void write_wave_data(FILE *out, const int16_t stereo_buf[], unsigned num_samples, struct PeakBuilder *peaks) {
+  for (unsigned start = 0; start < num_samples; start += OUTPUT_BLOCK_FRAMES) {
+    unsigned n = num_samples - start;
+    if (n > OUTPUT_BLOCK_FRAMES) { n = OUTPUT_BLOCK_FRAMES; }
+    write_bytes(out, (const char *) (stereo_buf + NUM_CHANNELS * start), n * NUM_CHANNELS * sizeof(int16_t));
+    if (peaks) {
+      peak_builder_add(peaks, stereo_buf + NUM_CHANNELS * start, n);
+    }
   }
-
-  // finally we're at the Subchunk2Size field, from which we can
-  // determine the number of samples
-  read_u32(in, &Subchunk2Size);
-  *num_samples = Subchunk2Size / NUM_CHANNELS / (BITS_PER_SAMPLE/8u);
 }
 
 void compute_pan(float angle, float channel_gain[]) {
@@ -108,44 +191,59 @@ void compute_pan(float angle, float channel_gain[]) {
 }
 
 void generate_sine_wave(int16_t mono_buf[], unsigned num_samples, float freq_hz) {
+  generate_sine_wave_at(mono_buf, 0, num_samples, freq_hz);
+}
+
+void generate_square_wave(int16_t mono_buf[], unsigned num_samples, float freq_hz) {
+  generate_square_wave_at(mono_buf, 0, num_samples, freq_hz);
+}
+
+void generate_saw_wave(int16_t mono_buf[], unsigned num_samples, float freq_hz) {
+  generate_saw_wave_at(mono_buf, 0, num_samples, freq_hz);
+}
+
+void generate_sine_wave_at(int16_t mono_buf[], unsigned first, unsigned num_samples, float freq_hz) {
   float time; 
-  for (unsigned int i = 0; i < num_samples; i++) {
+  for (unsigned int j = 0; j < num_samples; j++) {
+    unsigned int i = first + j;
     // calculate time variable since sample/(samples/sec) = time
     time = (float)i / (float)SAMPLES_PER_SECOND;
-    mono_buf[i] = INT16_MAX * sin(2 * PI * freq_hz * time);
+    mono_buf[j] = INT16_MAX * sin(2 * PI * freq_hz * time);
   }
 }
 
-void generate_square_wave(int16_t mono_buf[], unsigned num_samples, float freq_hz) {
+void generate_square_wave_at(int16_t mono_buf[], unsigned first, unsigned num_samples, float freq_hz) {
   int16_t temp; 
   float time; 
   // generate a sine wave and assign to mono_buf either max or min depending
   // on the sign of the sine
-  for (unsigned int i = 0; i < num_samples; i++) {
+  for (unsigned int j = 0; j < num_samples; j++) {
+    unsigned int i = first + j;
     time = (float)i/(float)(SAMPLES_PER_SECOND);
     temp = INT16_MAX * sin(2*PI*freq_hz*time);
     if (temp > 0) {
-      mono_buf[i] = INT16_MAX; 
+      mono_buf[j] = INT16_MAX; 
     } else {
-      mono_buf[i] = INT16_MIN; 
+      mono_buf[j] = INT16_MIN; 
     }
   }
 }
 
-void generate_saw_wave(int16_t mono_buf[], unsigned num_samples, float freq_hz) {
+void generate_saw_wave_at(int16_t mono_buf[], unsigned first, unsigned num_samples, float freq_hz) {
   double time;
   double temp;
   // T = 1/f
   float period = 1 / freq_hz;
-  for (unsigned int i = 0; i < num_samples; i++) {
+  for (unsigned int j = 0; j < num_samples; j++) {
+    unsigned int i = first + j;
     time = (1.0 / SAMPLES_PER_SECOND) * i;
     // get time-normalized value
     temp = (time / period) - floor(time / period);
     if (temp == 0.5) {
-      mono_buf[i] = 0;
+      mono_buf[j] = 0;
     } else {
       // if we're not in the middle, just assign it the line value
-      mono_buf[i] = temp * 65535.0 - 32767.0;
+      mono_buf[j] = temp * 65535.0 - 32767.0;
     }
   }
 }
@@ -165,45 +263,38 @@ void apply_gain(int16_t mono_buf[], unsigned num_samples, float gain) {
 
 
 void apply_adsr_envelope(int16_t mono_buf[], unsigned num_samples) {
+  apply_adsr_envelope_at(mono_buf, 0, num_samples, num_samples);
+}
+
+void apply_adsr_envelope_at(int16_t mono_buf[], unsigned first, unsigned count, unsigned num_samples) {
+  for (unsigned int j = 0; j < count; j++) {
+    mono_buf[j] *= adsr_level(first + j, num_samples);
+  }
+}
+
+float adsr_level(unsigned i, unsigned num_samples) {
   // Special Case - number of samples is less than required of Attack, Decay, and Release
   if (num_samples < ATTACK_NUM_SAMPLES + DECAY_NUM_SAMPLES + RELEASE_NUM_SAMPLES) {
-    float slope = 1.0f / (num_samples / 2);
-    for (unsigned int i = 0; i < num_samples; i++) {
-      if (i < (num_samples / 2) ) { // Rise
-        mono_buf[i] = (slope*i)*mono_buf[i]; 
-      }
-      else {			    // Fall
-	      mono_buf[i] = (-2.0f/num_samples) * (i - num_samples); 
-      }
+    if (i < (num_samples / 2) ) { // Rise
+      return (1.0f / (num_samples / 2)) * i;
     }
+    return (-2.0f/num_samples) * ((float) i - num_samples); // Fall
   }
 
   // Normal ADSR Envelope
-  else { 
-    float slope_A = 1.2f / ATTACK_NUM_SAMPLES;
-    float slope_D = -0.2f / DECAY_NUM_SAMPLES;
-    float slope_R = -1.0f / RELEASE_NUM_SAMPLES;
-    int32_t sustain = num_samples - (ATTACK_NUM_SAMPLES + DECAY_NUM_SAMPLES + RELEASE_NUM_SAMPLES);
-    int bound;
-    int i = 0;
-
-    // Attack
-    bound = ATTACK_NUM_SAMPLES;
-    for (; i < bound; i++) {
-      mono_buf[i] *= (slope_A * i); 
-    }
-    // Decay
-    bound += DECAY_NUM_SAMPLES;
-    for (; i < bound; i++) {
-      mono_buf[i] *= (1.2f + (slope_D * (i - ATTACK_NUM_SAMPLES)));
-    }
-    // Release
-    bound = num_samples;
-    i += sustain; 
-    for (; i < bound; i++) {
-      mono_buf[i] *= (1.0f + (slope_R * (i - (ATTACK_NUM_SAMPLES + DECAY_NUM_SAMPLES + sustain))));
-    }
+  float slope_A = 1.2f / ATTACK_NUM_SAMPLES;
+  float slope_D = -0.2f / DECAY_NUM_SAMPLES;
+  float slope_R = -1.0f / RELEASE_NUM_SAMPLES;
+  unsigned sustain = num_samples - (ATTACK_NUM_SAMPLES + DECAY_NUM_SAMPLES + RELEASE_NUM_SAMPLES);
+
+  if (i < ATTACK_NUM_SAMPLES) {                                  // Attack
+    return slope_A * i;
+  } else if (i < ATTACK_NUM_SAMPLES + DECAY_NUM_SAMPLES) {       // Decay
+    return 1.2f + (slope_D * (i - ATTACK_NUM_SAMPLES));
+  } else if (i >= ATTACK_NUM_SAMPLES + DECAY_NUM_SAMPLES + sustain) { // Release
+    return 1.0f + (slope_R * (i - (ATTACK_NUM_SAMPLES + DECAY_NUM_SAMPLES + sustain)));
   }
+  return 1.0f;                                                   // Sustain
 }
 
 void mix_in(int16_t stereo_buf[], unsigned channel, const int16_t mono_buf[], unsigned num_samples) {
@@ -222,3 +313,10 @@ void mix_in(int16_t stereo_buf[], unsigned channel, const int16_t mono_buf[], un
     stereo_buf[i + channel] = temp; 
   }
 }
+
+void mix_in_bus(int32_t stereo_bus[], unsigned channel, const int16_t mono_buf[], unsigned num_samples,
+                float gain) {
+  for (unsigned int i = 0; i < num_samples; i++) {
+    stereo_bus[2*i + channel] += (int32_t) (mono_buf[i] * gain);
+  }
+}
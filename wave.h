@@ -24,10 +24,45 @@
 #define DECAY_NUM_SAMPLES   882
 #define RELEASE_NUM_SAMPLES 882
 
+// format tags in the "fmt " chunk
+#define WAVE_FORMAT_PCM        1u
+#define WAVE_FORMAT_IEEE_FLOAT 3u
+#define WAVE_FORMAT_EXTENSIBLE 0xFFFEu
+
+// Sample format of a WAVE file's data chunk. For WAVE_FORMAT_EXTENSIBLE
+// files, format holds the tag from the SubFormat GUID.
+typedef struct {
+  uint16_t format;          // WAVE_FORMAT_PCM or WAVE_FORMAT_IEEE_FLOAT
+  uint16_t num_channels;    // 1 or 2
+  uint32_t sample_rate;
+  uint16_t bits_per_sample; // 8, 16, 24 or 32 (float is always 32)
+  uint16_t block_align;     // bytes per frame
+} WaveFormat;
+
+// The format the render tools work in: 16-bit stereo PCM at 44.1 kHz.
+extern const WaveFormat INTERNAL_FORMAT;
+
 // Functions for writing and reading a WAVE header.
+// read_wave_header only accepts the internal format.
 void write_wave_header(FILE *out, unsigned num_samples);
 void read_wave_header(FILE *in, unsigned *num_samples);
 
+// Write a header for any supported format (num_samples counts frames).
+// Non-PCM formats get the extended "fmt " chunk and a "fact" chunk.
+void write_wave_format(FILE *out, const WaveFormat *fmt, unsigned num_samples);
+
+// Read the RIFF/WAVE header and scan its chunks up to the start of the
+// "data" chunk, skipping any others (LIST, fact, ...). Unsupported
+// formats are fatal errors. num_samples is the number of frames.
+void read_wave_format(FILE *in, WaveFormat *fmt, unsigned *num_samples);
+
+// Write interleaved stereo sample data following the header in blocks of
+// OUTPUT_BLOCK_FRAMES. If peaks is non-NULL, each block is also fed to
+// the peak builder as it is written.
+#define OUTPUT_BLOCK_FRAMES 4096u
+struct PeakBuilder;
+void write_wave_data(FILE *out, const int16_t stereo_buf[], unsigned num_samples, struct PeakBuilder *peaks);
+
 // Compute appropriate gains for a stereo pan at given angle in radians.
 // Left and right channel gains are stored in the channel_gain array.
 void compute_pan(float angle, float channel_gain[]);
@@ -37,6 +72,12 @@ void generate_sine_wave(int16_t mono_buf[], unsigned num_samples, float freq_hz)
 void generate_square_wave(int16_t mono_buf[], unsigned num_samples, float freq_hz);
 void generate_saw_wave(int16_t mono_buf[], unsigned num_samples, float freq_hz);
 
+// Same, but for samples first .. first+num_samples-1 of the wave, so a long
+// note can be generated a block at a time.
+void generate_sine_wave_at(int16_t mono_buf[], unsigned first, unsigned num_samples, float freq_hz);
+void generate_square_wave_at(int16_t mono_buf[], unsigned first, unsigned num_samples, float freq_hz);
+void generate_saw_wave_at(int16_t mono_buf[], unsigned first, unsigned num_samples, float freq_hz);
+
 // Attenuate each sample in a mono sample buffer by specified factor
 void apply_gain(int16_t mono_buf[], unsigned num_samples, float gain);
 
@@ -46,9 +87,22 @@ void apply_gain(int16_t mono_buf[], unsigned num_samples, float gain);
 // signal's amplitude.
 void apply_adsr_envelope(int16_t mono_buf[], unsigned num_samples);
 
+// Apply the envelope for a note of num_samples samples to count samples
+// starting at sample first of the note.
+void apply_adsr_envelope_at(int16_t mono_buf[], unsigned first, unsigned count, unsigned num_samples);
+
+// Level of the envelope at sample i of a note num_samples long (peaks at 1.2).
+float adsr_level(unsigned i, unsigned num_samples);
+
 // Mix a mono sample buffer into a stereo stream.
 // channel should be 0 (left) or 1 (right).
 // stereo_buf should be pointing to a left-channel sample.
 void mix_in(int16_t stereo_buf[], unsigned channel, const int16_t mono_buf[], unsigned num_samples);
 
+// Same as mix_in, but scaling by gain into a wide stereo bus that is not
+// clipped; the output stage brings it back into 16-bit range. Apply gains
+// here rather than with apply_gain, which clips to 16 bits.
+void mix_in_bus(int32_t stereo_bus[], unsigned channel, const int16_t mono_buf[], unsigned num_samples,
+                float gain);
+
 #endif // WAVE_H